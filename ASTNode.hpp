@@ -1,13 +1,57 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cmath>
+#include <exception>
+#include <limits>
 #include <optional>
+#include <span>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include "Builtins.hpp"
+#include "Checkpoint.hpp"
+#include "CostCounter.hpp"
+#include "DispatchHistogram.hpp"
+#include "FlameGraph.hpp"
+#include "LiveStats.hpp"
+#include "LoopGuard.hpp"
+#include "Profiler.hpp"
+#include "RunStats.hpp"
 #include "SymbolTable.hpp"
+#include "Trace.hpp"
+
+class ASTNode;
+
+// Set (before running) for --sample, which also sets `instrumented`.
+inline bool sampling = false;
+
+// The statement the interpreter is executing right now, kept only while
+// sampling. The --sample signal handler reads it in the middle of whatever
+// this thread was doing, so it's a lock-free atomic (never torn), stored
+// relaxed with a signal fence after each store so the compiler can't move
+// the store past the work it marks. It always points into the tree.
+inline thread_local std::atomic<ASTNode const *> current_statement{nullptr};
+
+// Where print statements write. Parallel for bodies can't print, so only the
+// thread running the script ever uses it.
+inline thread_local std::ostream *script_output = &std::cout;
+
+// Set (before running) when any hook Run checks per node is on: --profile,
+// --flamegraph, --trace and the like. Run tests it once per node and only
+// goes near the hooks when it's set, so a plain run pays for one branch.
+inline bool instrumented = false;
+
+// Threads a parallel for splits its range across (--threads); 0 means one per
+// core. Results don't depend on it, only the speed does.
+inline size_t parallel_threads = 0;
+
 class ASTNode {
 
 private:
@@ -24,7 +68,14 @@ public:
     OPERATION,
     NUMBER,
     WHILE,
-    STRING
+    STRING,
+    FOR,
+    CALL,  // var_id is the function, children are the arguments
+    RETURN,
+    INDEX,    // var_id is the array, child is the index
+    ARRAY_OP, // element-wise literal (+ - * /) of two array or scalar operands
+    BUILTIN,  // var_id is a builtins::Id, child is the argument
+    NUM_TYPES // not a type: the count, for tables indexed by type
   };
   const Type type;
   double value{};
@@ -32,7 +83,9 @@ public:
   // can also serve as an operation name if of type OPERATION. Might also
   // change things so we have another enum of operator types.
   std::string literal{};
-  Token const *token = nullptr; // for error reporting
+  Token const *token = nullptr; // for error reporting (and source lines)
+
+  static constexpr size_t MAX_PARAMS = 16;
 
   ASTNode(Type type = EMPTY) : type(type) {};
   ASTNode(Type type, std::string literal) : type(type), literal(literal) {};
@@ -44,19 +97,202 @@ public:
 
   void AddChild(ASTNode node) {
     if (node) {
-      children.push_back(node);
+      children.push_back(std::move(node));
+    }
+  }
+
+  // pass subtrees as rvalues (std::move) so they're moved in, not copied
+  template <typename... Nodes> void AddChildren(Nodes &&...nodes) {
+    (AddChild(std::forward<Nodes>(nodes)), ...);
+  }
+
+  // every variable this subtree can assign, including loop variables and
+  // globals written by functions it calls
+  void CollectWrites(std::vector<size_t> &var_ids,
+                     SymbolTable const &symbols) const {
+    if (type == ASSIGN || type == FOR) {
+      var_ids.push_back(children.at(0).var_id);
+    }
+    if (type == CALL) {
+      std::vector<size_t> const &writes = symbols.GetFunction(var_id).global_writes;
+      var_ids.insert(var_ids.end(), writes.begin(), writes.end());
+    }
+    for (ASTNode const &child : children) {
+      child.CollectWrites(var_ids, symbols);
+    }
+  }
+
+  size_t CountNodes() const {
+    size_t count = 1;
+    for (ASTNode const &child : children) {
+      count += child.CountNodes();
+    }
+    return count;
+  }
+
+  size_t NumChildren() const { return children.size(); }
+  ASTNode const &GetChild(size_t idx) const { return children.at(idx); }
+
+  // nodes that show up as statements in the source (scopes just group them)
+  bool IsStatement() const {
+    return type == PRINT || type == ASSIGN || type == WHILE || type == FOR ||
+           type == CONDITIONAL || type == RETURN;
+  }
+
+  // label for nodes that enclose other statements, nullptr for the rest
+  char const *BlockName() const {
+    switch (type) {
+    case SCOPE:
+      return "scope";
+    case WHILE:
+      return "while";
+    case FOR:
+      return "for";
+    case CONDITIONAL:
+      return "if";
+    default:
+      return nullptr;
+    }
+  }
+
+  static char const *TypeName(int type) {
+    switch (type) {
+    case EMPTY:
+      return "empty";
+    case SCOPE:
+      return "scope";
+    case PRINT:
+      return "print";
+    case ASSIGN:
+      return "assign";
+    case IDENTIFIER:
+      return "identifier";
+    case CONDITIONAL:
+      return "conditional";
+    case OPERATION:
+      return "operation";
+    case NUMBER:
+      return "number";
+    case WHILE:
+      return "while";
+    case STRING:
+      return "string";
+    case FOR:
+      return "for";
+    case CALL:
+      return "call";
+    case RETURN:
+      return "return";
+    case INDEX:
+      return "index";
+    case ARRAY_OP:
+      return "array-op";
+    case BUILTIN:
+      return "builtin";
+    default:
+      return "unknown";
+    }
+  }
+
+  // restores the enclosing statement once a nested one finishes, so time
+  // spent in ex. a loop condition is charged to the loop
+  class StatementMarker {
+  private:
+    ASTNode const *outer = nullptr;
+    bool active;
+
+    static void Mark(ASTNode const *node) {
+      current_statement.store(node, std::memory_order_relaxed);
+      std::atomic_signal_fence(std::memory_order_seq_cst);
     }
+
+  public:
+    StatementMarker(ASTNode const &node)
+        : active(sampling && node.IsStatement()) {
+      if (active) {
+        outer = current_statement.load(std::memory_order_relaxed);
+        Mark(&node);
+      }
+    }
+    ~StatementMarker() {
+      if (active) {
+        Mark(outer);
+      }
+    }
+    StatementMarker(StatementMarker const &) = delete;
+    StatementMarker &operator=(StatementMarker const &) = delete;
+  };
+
+  std::optional<double> Run(SymbolTable &symbols) const {
+    if (IsStatement()) {
+      MC_TRACEPOINT(statement, type, token ? token->line_id : 0);
+    }
+    if (instrumented) {
+      return RunInstrumented(symbols);
+    }
+    return RunNode(symbols);
+  }
+
+  // Run, through whichever hooks are on
+  std::optional<double> RunInstrumented(SymbolTable &symbols) const {
+    StatementMarker marker{*this};
+    if (run_stats && IsStatement()) {
+      ++run_stats->statements;
+    }
+    if (live_stats && IsStatement()) {
+      live_counter.Statement(token ? token->line_id : 0);
+    }
+    if (dispatch_histogram) {
+      dispatch_histogram->Record(type);
+    }
+    Profiler::Timer timer{IsStatement() ? profiler : nullptr, token};
+    char const *block = BlockName();
+    FlameGraph::Timer frame{block ? flamegraph : nullptr, token, block};
+    Tracer *statement_tracer = IsStatement() ? tracer : nullptr;
+    Tracer::Statement span{statement_tracer,
+                           statement_tracer ? TypeName(type) : nullptr, token,
+                           type == WHILE || type == FOR};
+    if (!cost_counter) {
+      return RunNode(symbols);
+    }
+    CountCost(*cost_counter);
+    std::optional<double> result = RunNode(symbols);
+    if (type == ASSIGN) {
+      CountAssign(*cost_counter, symbols);
+    }
+    return result;
   }
 
-  template <typename T, typename... Rest>
-  void AddChildren(T node, Rest... rest) {
-    AddChild(node);
-    AddChildren(rest...);
+  // --cost work that doesn't depend on how the node runs, counted as it
+  // starts
+  void CountCost(CostCounter &cost) const {
+    ++cost.dispatches;
+    switch (type) {
+    case IDENTIFIER:
+    case INDEX:
+      ++cost.reads;
+      break;
+    case OPERATION:
+    case BUILTIN:
+      ++cost.arithmetic;
+      break;
+    default:
+      break;
+    }
   }
 
-  template <typename T> void AddChildren(T node) { AddChild(node); }
+  // an assignment's writes, counted once it has succeeded
+  void CountAssign(CostCounter &cost, SymbolTable const &symbols) const {
+    if (literal.empty()) {
+      ++cost.writes;
+      return;
+    }
+    size_t length = symbols.Length(children[0].var_id);
+    cost.writes += length;
+    cost.arithmetic += children[1].CountArrayOps(symbols) * length;
+  }
 
-  std::optional<double> Run(SymbolTable &symbols) {
+  std::optional<double> RunNode(SymbolTable &symbols) const {
     switch (type) {
     case EMPTY:
       return std::nullopt;
@@ -81,13 +317,25 @@ public:
     case WHILE:
       RunWhile(symbols);
       return std::nullopt;
+    case FOR:
+      RunFor(symbols);
+      return std::nullopt;
+    case CALL:
+      return RunCall(symbols);
+    case RETURN:
+      symbols.Return(children.at(0).RunExpect(symbols));
+      return std::nullopt;
+    case INDEX:
+      return RunIndex(symbols);
+    case BUILTIN:
+      return RunBuiltin(symbols);
     default:
       assert(false);
       return std::nullopt; // rose: thank you gcc very cool
     };
   }
 
-  double RunExpect(SymbolTable &symbols) {
+  double RunExpect(SymbolTable &symbols) const {
     if (auto result = Run(symbols)) {
       return result.value();
     }
@@ -98,60 +346,591 @@ public:
   // they'll be making recursive calls to Run, some of which will need to make
   // changes to the symbol table, so none of them are constant except the one in
   // RunIdentifier
-  void RunScope(SymbolTable &symbols) {
+  void RunScope(SymbolTable &symbols) const {
     // push a new scope
     // run each child node in order
     // pop scope
-    for (ASTNode child : children) {
-      child.Run(symbols);
+    size_t start = 0;
+    if (checkpointer && checkpointer->Resuming()) {
+      start = checkpointer->NextResumeFrame().index;
+    }
+    for (size_t i = start; i < children.size(); ++i) {
+      if (checkpointer) {
+        checkpointer->PushFrame({i});
+        checkpointer->Step(symbols);
+      }
+      children[i].Run(symbols);
+      if (checkpointer) {
+        checkpointer->PopFrame();
+      }
+      if (symbols.Returning()) {
+        break;
+      }
     }
   }
-  void RunPrint(SymbolTable &symbols) {
+  void RunPrint(SymbolTable &symbols) const {
     // iterate over children
     // if child is an expression or number, run it and print the value it
     // returns if it's a string literal, print it need to do something about
     // identifiers in curly braces
+    std::ostringstream line{};
     for (ASTNode child : children) {
       if (child.type == ASTNode::STRING) {
-        std::cout << child.literal;
+        line << child.literal;
       } else {
-        std::cout << child.RunExpect(symbols);
+        line << child.RunExpect(symbols);
       }
     }
-    std::cout << std::endl;
+    line << '\n';
+    *script_output << line.str() << std::flush;
+    MC_TRACEPOINT(print, line.str().size(), token ? token->line_id : 0);
+    if (checkpointer) {
+      checkpointer->CountOutput(line.str().size());
+    }
+    if (instrumented) {
+      if (cost_counter) {
+        cost_counter->formatted_bytes += line.str().size();
+      }
+      if (tracer) {
+        tracer->CountOutput(line.str().size());
+      }
+      if (live_stats) {
+        LiveStats::Add(live_stats->prints);
+        LiveStats::Add(live_stats->bytes_written, line.str().size());
+      }
+    }
+    if (loop_guard) {
+      loop_guard->CountPrint();
+    }
   }
-  void RunAssign(SymbolTable &symbols) {
+  // the target is an IDENTIFIER, or an INDEX for `a[i] = x;`; literal is
+  // "array" when the whole of an array is assigned
+  void RunAssign(SymbolTable &symbols) const {
     assert(children.size() == 2);
-    symbols.SetValue(children.at(0).var_id, children.at(1).RunExpect(symbols));
+    ASTNode const &target = children[0];
+    if (!literal.empty()) {
+      RunArrayAssign(symbols);
+      return;
+    }
+    if (target.type == INDEX) {
+      double index = target.children.at(0).RunExpect(symbols);
+      double new_value = children[1].RunExpect(symbols);
+      if (target.literal == "unchecked") {
+        symbols.GetArray(target.var_id)[static_cast<size_t>(index)] = new_value;
+      } else {
+        symbols.SetElement(target.var_id, index, new_value, *target.token);
+      }
+    } else {
+      symbols.SetValue(target.var_id, children[1].RunExpect(symbols));
+    }
+  }
+  double RunIndex(SymbolTable &symbols) const {
+    double index = children.at(0).RunExpect(symbols);
+    // "unchecked" when the parser proved the index in range
+    if (literal == "unchecked") {
+      return symbols.GetArray(var_id)[static_cast<size_t>(index)];
+    }
+    return symbols.GetElement(var_id, index, *token);
   }
-  double RunIdentifier(SymbolTable &symbols) {
+
+  double RunBuiltin(SymbolTable &symbols) const {
+    double arg = children.at(0).RunExpect(symbols);
+    return builtins::Scalar(static_cast<builtins::Id>(var_id), arg);
+  }
+
+  // One side of an ARRAY_OP for the block being computed: `data` points at
+  // its elements, or is null for a scalar.
+  struct Operand {
+    double const *data = nullptr;
+    double scalar = 0;
+  };
+
+  // a built-in applied to an array operand is one too, and runs batched
+  bool IsArrayOperand(SymbolTable const &symbols) const {
+    return type == ARRAY_OP ||
+           (type == IDENTIFIER && symbols.IsArray(var_id)) ||
+           (type == BUILTIN && children[0].IsArrayOperand(symbols));
+  }
+
+  // scalar operands, evaluated once per statement in pre-order
+  void RunScalarOperands(SymbolTable &symbols, std::vector<double> &out) const {
+    if (!IsArrayOperand(symbols)) {
+      out.push_back(RunExpect(symbols));
+      return;
+    }
+    for (ASTNode const &child : children) {
+      child.RunScalarOperands(symbols, out);
+    }
+  }
+
+  Operand RunArrayBlock(SymbolTable &symbols, size_t begin, size_t n,
+                        std::vector<double> const &scalars,
+                        size_t &next_scalar) const {
+    if (!IsArrayOperand(symbols)) {
+      return {nullptr, scalars[next_scalar++]};
+    }
+    if (type == IDENTIFIER) {
+      return {symbols.GetArray(var_id).Data() + begin};
+    }
+    if (type == BUILTIN) {
+      Operand arg = children[0].RunArrayBlock(symbols, begin, n, scalars,
+                                              next_scalar);
+      auto id = static_cast<builtins::Id>(var_id);
+      if (!arg.data) {
+        return {nullptr, builtins::Scalar(id, arg.scalar)};
+      }
+      double *out = kernels::scratch.Next();
+      builtins::Batch(id, out, arg.data, n);
+      return {out};
+    }
+    Operand lhs = children[0].RunArrayBlock(symbols, begin, n, scalars, next_scalar);
+    Operand rhs = children[1].RunArrayBlock(symbols, begin, n, scalars, next_scalar);
+    char op = literal[0];
+    if (op == '/' && (rhs.data ? kernels::AnyZero(rhs.data, n) : rhs.scalar == 0)) {
+      Error(*token, "division by zero");
+    }
+    if (!lhs.data && !rhs.data) {
+      return {nullptr, ApplyOp(op, lhs.scalar, rhs.scalar)};
+    }
+    double *out = kernels::scratch.Next();
+    switch (op) {
+    case '+':
+      ApplyKernel<kernels::Add>(out, lhs, rhs, n);
+      break;
+    case '-':
+      ApplyKernel<kernels::Subtract>(out, lhs, rhs, n);
+      break;
+    case '*':
+      ApplyKernel<kernels::Multiply>(out, lhs, rhs, n);
+      break;
+    default:
+      ApplyKernel<kernels::Divide>(out, lhs, rhs, n);
+      break;
+    }
+    return {out};
+  }
+
+  static double ApplyOp(char op, double lhs, double rhs) {
+    switch (op) {
+    case '+':
+      return lhs + rhs;
+    case '-':
+      return lhs - rhs;
+    case '*':
+      return lhs * rhs;
+    default:
+      return lhs / rhs;
+    }
+  }
+
+  template <typename Op>
+  static void ApplyKernel(double *out, Operand lhs, Operand rhs, size_t n) {
+    if (!lhs.data) {
+      kernels::ApplyScalarLeft<Op>(out, lhs.scalar, rhs.data, n);
+    } else if (!rhs.data) {
+      kernels::ApplyScalarRight<Op>(out, lhs.data, rhs.scalar, n);
+    } else {
+      kernels::Apply<Op>(out, lhs.data, rhs.data, n);
+    }
+  }
+
+  // `c = a + b * 2;` for arrays of one length (the parser checked), a block
+  // of kernels::BLOCK elements at a time so the temporaries stay in cache.
+  // Each block is finished before it's stored, so the target can also be an
+  // operand.
+  void RunArrayAssign(SymbolTable &symbols) const {
+    std::vector<double> scalars{};
+    children[1].RunScalarOperands(symbols, scalars);
+    AlignedArray &target = symbols.GetArray(children[0].var_id);
+    size_t length = target.Length();
+    for (size_t begin = 0; begin < length; begin += kernels::BLOCK) {
+      size_t n = std::min(kernels::BLOCK, length - begin);
+      size_t next_scalar = 0;
+      kernels::scratch.Reset();
+      Operand result = children[1].RunArrayBlock(symbols, begin, n, scalars,
+                                                 next_scalar);
+      double *out = target.Data() + begin;
+      if (!result.data) {
+        std::fill_n(out, n, result.scalar);
+      } else if (result.data != out) {
+        std::copy_n(result.data, n, out);
+      }
+    }
+  }
+
+  // element-wise operations and built-ins run per element
+  size_t CountArrayOps(SymbolTable const &symbols) const {
+    if (!IsArrayOperand(symbols)) {
+      return 0;
+    }
+    size_t count = type == IDENTIFIER ? 0 : 1;
+    for (ASTNode const &child : children) {
+      count += child.CountArrayOps(symbols);
+    }
+    return count;
+  }
+  double RunIdentifier(SymbolTable &symbols) const {
     assert(value == double{});
     assert(literal == std::string{});
 
     return symbols.GetValue(var_id, token);
   }
-  void RunConditional([[maybe_unused]] SymbolTable &symbols) {
+  // Arguments are evaluated in the caller's frame, then the function's frame
+  // is entered; a pure function's result is looked up in its memo cache
+  // first. Checkpoints are only taken outside calls, since a restore can't
+  // rebuild the frames of calls in progress.
+  double RunCall(SymbolTable &symbols) const {
+    FunctionInfo const &function =
+        std::as_const(symbols).GetFunction(var_id);
+    std::array<double, MAX_PARAMS> args{};
+    for (size_t i = 0; i < children.size(); ++i) {
+      args[i] = children[i].RunExpect(symbols);
+    }
+    std::span<double const> key{args.data(), children.size()};
+    CostCounter *cost = instrumented ? cost_counter : nullptr;
+    if (function.pure) {
+      std::optional<double> result = symbols.FindMemo(var_id, key);
+      if (cost) {
+        ++(result ? cost->memo_hits : cost->memo_misses);
+      }
+      if (result) {
+        return *result;
+      }
+    }
+
+    class Frame {
+    private:
+      SymbolTable &symbols;
+      FunctionInfo const &function;
+      Checkpointer *outer_checkpointer;
+
+    public:
+      Frame(SymbolTable &symbols, FunctionInfo const &function, size_t line)
+          : symbols(symbols), function(function),
+            outer_checkpointer(checkpointer) {
+        symbols.EnterFrame(function, line);
+        checkpointer = nullptr;
+      }
+      ~Frame() {
+        symbols.LeaveFrame(function);
+        checkpointer = outer_checkpointer;
+      }
+      Frame(Frame const &) = delete;
+      Frame &operator=(Frame const &) = delete;
+    };
+
+    double result = 0;
+    {
+      Frame frame{symbols, function, token->line_id};
+      for (size_t i = 0; i < function.num_params; ++i) {
+        symbols.SetValue(function.frame_base + i, args[i]);
+      }
+      if (cost) {
+        cost->writes += function.num_params;
+      }
+      // the parser made sure the body ends in a return
+      function.body->Run(symbols);
+      result = symbols.ReturnValue();
+    }
+    if (function.pure && symbols.StoreMemo(var_id, key, result) && cost) {
+      ++cost->memo_evictions;
+    }
+    return result;
+  }
+
+  void RunConditional([[maybe_unused]] SymbolTable &symbols) const {
     // conditional statement is of the form "if (expression1) statment1 else
     // statement2" so a conditional node should have 2 or 3 children: an
     // expression, a statement, and possibly another statement run the first
     // one; if it gives a nonzero value, run the second; otherwise, run the
     // third, if it exists
   }
-  double RunOperation([[maybe_unused]] SymbolTable &symbols) {
+  double RunOperation([[maybe_unused]] SymbolTable &symbols) const {
     // node will have an operator (e.g. +, *, etc.) specified somewhere (maybe
     // in the "literal"?) and one or two children run the child or children,
     // apply the operator to the returned value(s), then return the result
     return 0;
   }
-  void RunWhile(SymbolTable & symbols){
+  void RunWhile(SymbolTable & symbols) const {
     assert(children.size() == 2);
     assert(value == double{});
     assert(literal == std::string{});
 
-    ASTNode condition = children[0];
-    ASTNode body = children[1];
-    while (condition.RunExpect(symbols)){
+    ASTNode const &condition = children[0];
+    ASTNode const &body = children[1];
+    std::optional<LoopGuard::Tracker> tracker{};
+    if (loop_guard) {
+      std::vector<size_t> written{};
+      body.CollectWrites(written, symbols);
+      tracker.emplace(*loop_guard, written);
+    }
+    bool live = instrumented && live_stats;
+    Profiler::clock::time_point entered{};
+    uint64_t iterations = 0;
+    if (profiler) {
+      entered = Profiler::clock::now();
+    }
+    // a restored checkpoint drops us back inside the body
+    bool resume_body = checkpointer && checkpointer->Resuming();
+    if (resume_body) {
+      checkpointer->NextResumeFrame();
+    }
+    while (resume_body || condition.RunExpect(symbols)) {
+      resume_body = false;
+      ++iterations;
+      MC_TRACEPOINT(loop_iteration, token->line_id, iterations);
+      if (live) {
+        live_counter.Iterations();
+      }
+      if (checkpointer) {
+        checkpointer->PushFrame({});
+      }
       body.Run(symbols);
+      if (checkpointer) {
+        checkpointer->PopFrame();
+      }
+      if (symbols.Returning()) {
+        break;
+      }
+      if (tracker && tracker->Repeated(symbols)) {
+        Error(*token, "infinite loop detected: loop state repeats without"
+                      " producing output");
+      }
+    }
+    if (profiler) {
+      profiler->AddBlock(token, "while", iterations,
+                         Profiler::clock::now() - entered);
+    }
+  }
+
+  // children: loop variable, start, end, reductions (if any), body
+  void RunFor(SymbolTable &symbols) const {
+    assert(children.size() >= 4);
+
+    size_t loop_var = children.at(0).var_id;
+    // loaded once rather than per iteration
+    CostCounter *cost = instrumented ? cost_counter : nullptr;
+    bool live = instrumented && live_stats;
+    double start{};
+    double end{};
+    if (checkpointer && checkpointer->Resuming()) {
+      // pick up at the iteration the checkpoint was taken in
+      end = checkpointer->NextResumeFrame().loop_end;
+      start = symbols.GetValue(loop_var, children.at(0).token);
+      if (cost) {
+        ++cost->reads;
+      }
+    } else {
+      start = children.at(1).RunExpect(symbols);
+      end = children.at(2).RunExpect(symbols);
+    }
+    if (start != std::floor(start) || end != std::floor(end)) {
+      Error(*token, "for-loop bounds must be integers");
+    }
+
+    Profiler::clock::time_point entered{};
+    if (profiler) {
+      entered = Profiler::clock::now();
+    }
+    ASTNode const &body = children.back();
+    if (literal == "parallel") {
+      RunParallelFor(symbols, start, end);
+    } else {
+      for (double i = start; i < end; ++i) {
+        symbols.SetValue(loop_var, i);
+        MC_TRACEPOINT(loop_iteration, token->line_id, i - start + 1);
+        if (cost) {
+          ++cost->writes;
+          ++cost->arithmetic;
+        }
+        if (live) {
+          live_counter.Iterations();
+        }
+        if (checkpointer) {
+          checkpointer->PushFrame({0, end});
+        }
+        body.Run(symbols);
+        if (checkpointer) {
+          checkpointer->PopFrame();
+        }
+        if (symbols.Returning()) {
+          return;
+        }
+      }
+    }
+    symbols.SetValue(loop_var, std::max(start, end));
+    if (cost) {
+      ++cost->writes;
+    }
+    if (profiler) {
+      profiler->AddBlock(token, literal == "parallel" ? "parallel-for" : "for",
+                         static_cast<uint64_t>(std::max(end - start, 0.0)),
+                         Profiler::clock::now() - entered);
+    }
+  }
+
+  static double ReductionIdentity(std::string const &op) {
+    if (op == "+") {
+      return 0.0;
+    } else if (op == "*") {
+      return 1.0;
+    } else if (op == "min") {
+      return std::numeric_limits<double>::infinity();
+    }
+    assert(op == "max");
+    return -std::numeric_limits<double>::infinity();
+  }
+
+  static double ReductionCombine(std::string const &op, double lhs,
+                                 double rhs) {
+    if (op == "+") {
+      return lhs + rhs;
+    } else if (op == "*") {
+      return lhs * rhs;
+    } else if (op == "min") {
+      return std::min(lhs, rhs);
+    }
+    assert(op == "max");
+    return std::max(lhs, rhs);
+  }
+
+  // Iterations of a parallel for are folded in blocks of this many, whatever
+  // the thread count, so the result only depends on the range.
+  static constexpr size_t PARALLEL_BLOCK = 4096;
+
+  // The parser has already checked that the body only writes its own locals
+  // and the reduction variables, so each thread gets a worker table with its
+  // own copy of those (SymbolTable::Worker) and a contiguous run of blocks. Every iteration starts its
+  // reduction variables at the identity, and whatever they hold after the
+  // body is that iteration's contribution. A block folds its contributions
+  // in order into one partial, and the partials are folded into the shared
+  // value in block order once every thread is done, so the result is the
+  // same for any number of threads (including one).
+  void RunParallelFor(SymbolTable &symbols, double start, double end) const {
+    size_t loop_var = children.at(0).var_id;
+    size_t count = end > start ? static_cast<size_t>(end - start) : 0;
+    size_t num_blocks = (count + PARALLEL_BLOCK - 1) / PARALLEL_BLOCK;
+    size_t num_threads = parallel_threads
+                             ? parallel_threads
+                             : std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min(num_threads, num_blocks);
+
+    std::vector<ASTNode const *> reductions{};
+    for (size_t i = 3; i + 1 < children.size(); ++i) {
+      reductions.push_back(&children[i]);
+    }
+    // partials[r][b]: reduction r folded over block b
+    std::vector<std::vector<double>> partials(reductions.size(),
+                                              std::vector<double>(num_blocks));
+
+    // everything else the body reads is shared with this table
+    ASTNode const &body = children.back();
+    std::vector<size_t> written{loop_var};
+    body.CollectWrites(written, symbols);
+    std::vector<CostCounter> costs(cost_counter ? num_threads : 0);
+    std::vector<DispatchHistogram> histograms(dispatch_histogram ? num_threads
+                                                                 : 0);
+    std::vector<RunStats> stats(run_stats ? num_threads : 0);
+    std::vector<Profiler> profiles(profiler ? num_threads : 0);
+    // errors in a worker are handled the way the calling thread handles them
+    bool parent_throw_on_error = throw_on_error;
+    std::ostream *parent_error_output = error_output;
+    std::vector<std::exception_ptr> failures(num_threads);
+    std::vector<std::thread> workers{};
+    for (size_t t = 0; t < num_threads; ++t) {
+      workers.emplace_back([&, t]() {
+        throw_on_error = parent_throw_on_error;
+        error_output = parent_error_output;
+        SymbolTable frame = symbols.Worker(written);
+        if (sampling) {
+          current_statement.store(this, std::memory_order_relaxed);
+        }
+        if (!costs.empty()) {
+          cost_counter = &costs[t];
+        }
+        if (!histograms.empty()) {
+          dispatch_histogram = &histograms[t];
+        }
+        if (!stats.empty()) {
+          run_stats = &stats[t];
+        }
+        if (!profiles.empty()) {
+          profiler = &profiles[t];
+        }
+        size_t first_block = num_blocks * t / num_threads;
+        size_t last_block = num_blocks * (t + 1) / num_threads;
+        try {
+          for (size_t b = first_block; b < last_block; ++b) {
+            for (size_t r = 0; r < reductions.size(); ++r) {
+              partials[r][b] = ReductionIdentity(reductions[r]->literal);
+            }
+            size_t block_end = std::min(count, (b + 1) * PARALLEL_BLOCK);
+            if (cost_counter) {
+              cost_counter->writes += block_end - b * PARALLEL_BLOCK;
+              cost_counter->arithmetic += block_end - b * PARALLEL_BLOCK;
+            }
+            for (size_t k = b * PARALLEL_BLOCK; k < block_end; ++k) {
+              double i = start + static_cast<double>(k);
+              frame.SetValue(loop_var, i);
+              MC_TRACEPOINT(loop_iteration, token->line_id, k + 1);
+              for (ASTNode const *reduction : reductions) {
+                frame.SetValue(reduction->var_id,
+                                   ReductionIdentity(reduction->literal));
+              }
+              body.Run(frame);
+              for (size_t r = 0; r < reductions.size(); ++r) {
+                partials[r][b] = ReductionCombine(
+                    reductions[r]->literal, partials[r][b],
+                    frame.GetValue(reductions[r]->var_id, nullptr));
+              }
+            }
+          }
+        } catch (ErrorException const &) {
+          failures[t] = std::current_exception();
+        }
+      });
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+    for (std::exception_ptr const &failure : failures) {
+      if (failure) {
+        std::rethrow_exception(failure);
+      }
+    }
+    for (CostCounter const &worker_cost : costs) {
+      *cost_counter += worker_cost;
+    }
+    for (DispatchHistogram const &histogram : histograms) {
+      dispatch_histogram->Merge(histogram);
+    }
+    for (RunStats const &worker_stats : stats) {
+      run_stats->Merge(worker_stats);
+    }
+    for (Profiler const &profile : profiles) {
+      profiler->Merge(profile);
+    }
+    if (instrumented && live_stats) {
+      live_counter.Iterations(count);
+    }
+
+    for (size_t r = 0; r < reductions.size(); ++r) {
+      ASTNode const &reduction = *reductions[r];
+      double result = symbols.GetValue(reduction.var_id, reduction.token);
+      for (double partial : partials[r]) {
+        result = ReductionCombine(reduction.literal, result, partial);
+      }
+      symbols.SetValue(reduction.var_id, result);
+      // one combine per iteration, whatever the thread count
+      if (cost_counter) {
+        ++cost_counter->reads;
+        ++cost_counter->writes;
+        cost_counter->arithmetic += count;
+      }
     }
   }
 };
+
+// DispatchHistogram.hpp is included above, so it can't use NUM_TYPES itself
+static_assert(DispatchHistogram::NUM_KINDS == ASTNode::NUM_TYPES,
+              "DispatchHistogram::NUM_KINDS must match the node types");
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+// Storage for `var a[N];`: N doubles, zeroed, starting on a 64-byte
+// boundary so every kernel block starts on a cache line and aligned vector
+// loads are always legal. Copies are deep; View() shares the elements
+// instead (parallel for workers read shared arrays through views).
+class AlignedArray {
+public:
+  static constexpr size_t ALIGNMENT = 64;
+  static constexpr size_t MAX_LENGTH = size_t{1} << 30;
+
+private:
+  struct Free {
+    bool owned; // false for a View()
+    void operator()(double *data) const {
+      if (owned) {
+        std::free(data);
+      }
+    }
+  };
+  std::unique_ptr<double[], Free> storage{nullptr, Free{true}};
+  size_t length = 0;
+
+  static double *Allocate(size_t length) {
+    size_t bytes = (length * sizeof(double) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    auto *data = static_cast<double *>(std::aligned_alloc(ALIGNMENT, bytes));
+    if (!data) {
+      throw std::bad_alloc{};
+    }
+    std::fill_n(data, length, 0.0);
+    return data;
+  }
+
+public:
+  AlignedArray() = default;
+  explicit AlignedArray(size_t length)
+      : storage(length ? Allocate(length) : nullptr, Free{true}),
+        length(length) {}
+
+  AlignedArray(AlignedArray const &other) : AlignedArray(other.length) {
+    std::copy_n(other.Data(), length, Data());
+  }
+  AlignedArray &operator=(AlignedArray const &other) {
+    if (this != &other) {
+      AlignedArray copy{other};
+      std::swap(storage, copy.storage);
+      std::swap(length, copy.length);
+    }
+    return *this;
+  }
+  AlignedArray(AlignedArray &&) = default;
+  AlignedArray &operator=(AlignedArray &&) = default;
+
+  // an array reading `other`'s elements without owning them; it must not
+  // outlive other
+  static AlignedArray View(AlignedArray const &other) {
+    AlignedArray view{};
+    view.storage = {other.storage.get(), Free{false}};
+    view.length = other.length;
+    return view;
+  }
+
+  size_t Length() const { return length; }
+  double *Data() { return std::assume_aligned<ALIGNMENT>(storage.get()); }
+  double const *Data() const {
+    return std::assume_aligned<ALIGNMENT>(storage.get());
+  }
+  double &operator[](size_t index) { return storage[index]; }
+  double operator[](size_t index) const { return storage[index]; }
+};
+
+// Element-wise kernels for whole-array expressions, run a block at a time
+// (BLOCK elements, so operands and temporaries stay in L1). They're cloned
+// for AVX2 and AVX-512 where the compiler and loader support it, with the
+// best one picked at load time; the loops themselves are plain enough for
+// the vectorizer at -O3. (MC_KERNEL and the options below are also used by
+// Builtins.hpp.)
+namespace kernels {
+
+inline constexpr size_t BLOCK = 256;
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define MC_KERNEL [[gnu::target_clones("avx512f", "avx2", "default")]]
+#else
+#define MC_KERNEL
+#endif
+
+// Code between MC_KERNEL_OPTIONS_BEGIN and _END is built without FMA
+// contraction, so a vectorized loop rounds exactly like the scalar code, and
+// without FP exception flags, which would keep loops with selects from
+// vectorizing. The rest of the build keeps the default FP options. (GCC
+// won't inline functions built with other options into this code.)
+#if defined(__GNUC__) && !defined(__clang__)
+#define MC_KERNEL_OPTIONS_BEGIN                                                \
+  _Pragma("GCC push_options")                                                  \
+      _Pragma("GCC optimize(\"fp-contract=off,no-trapping-math\")")
+#define MC_KERNEL_OPTIONS_END _Pragma("GCC pop_options")
+#else
+#define MC_KERNEL_OPTIONS_BEGIN
+#define MC_KERNEL_OPTIONS_END
+#endif
+
+MC_KERNEL_OPTIONS_BEGIN
+
+// out = lhs op rhs, element-wise; the ScalarLeft/Right forms broadcast one
+// side. `out` may not alias an operand.
+template <typename Op>
+MC_KERNEL void Apply(double *__restrict out, double const *__restrict lhs,
+                     double const *__restrict rhs, size_t n) {
+  Op op{};
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = op(lhs[i], rhs[i]);
+  }
+}
+
+template <typename Op>
+MC_KERNEL void ApplyScalarRight(double *__restrict out,
+                                double const *__restrict lhs, double rhs,
+                                size_t n) {
+  Op op{};
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = op(lhs[i], rhs);
+  }
+}
+
+template <typename Op>
+MC_KERNEL void ApplyScalarLeft(double *__restrict out, double lhs,
+                               double const *__restrict rhs, size_t n) {
+  Op op{};
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = op(lhs, rhs[i]);
+  }
+}
+
+// The element-wise operators. std::plus and friends are built with the
+// default options, and GCC won't inline them into the kernels.
+struct Add {
+  double operator()(double lhs, double rhs) const { return lhs + rhs; }
+};
+struct Subtract {
+  double operator()(double lhs, double rhs) const { return lhs - rhs; }
+};
+struct Multiply {
+  double operator()(double lhs, double rhs) const { return lhs * rhs; }
+};
+struct Divide {
+  double operator()(double lhs, double rhs) const { return lhs / rhs; }
+};
+
+// division by zero is an error in scripts, so divisors are checked first
+MC_KERNEL inline bool AnyZero(double const *__restrict values, size_t n) {
+  bool zero = false;
+  for (size_t i = 0; i < n; ++i) {
+    zero |= values[i] == 0.0;
+  }
+  return zero;
+}
+
+MC_KERNEL_OPTIONS_END
+
+// Per-thread block temporaries for array expressions, reused from statement
+// to statement: Reset() before each block, then Next() once per operation.
+class Scratch {
+private:
+  std::vector<AlignedArray> blocks{};
+  size_t used = 0;
+
+public:
+  void Reset() { used = 0; }
+  double *Next() {
+    if (used == blocks.size()) {
+      blocks.emplace_back(BLOCK);
+    }
+    return blocks[used++].Data();
+  }
+};
+
+inline thread_local Scratch scratch{};
+
+} // namespace kernels
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string_view>
+
+#include "Array.hpp"
+
+// Built-in math functions: sqrt, sin, exp, log, floor, abs. Calls are
+// resolved to an Id while parsing, and run through a switch straight into
+// the function, with no lookup by name at run time.
+//
+// Each one has a scalar form and a batched form that array expressions use
+// a block at a time. Both must give bit-identical results, so:
+//   - sqrt, floor and abs are exact (correctly rounded) in any form;
+//   - sin, exp and log are our own straight-line polynomial code, with no
+//     branches or table lookups, inlined into both the scalar functions and
+//     the batch loops (which the vectorizer turns into SIMD). Every step is
+//     a plain IEEE operation, and everything below is built with FMA
+//     contraction off (MC_KERNEL_OPTIONS_BEGIN), so each lane does exactly
+//     what the scalar code does.
+// They're within an ulp or so of the C library, except that sin loses a
+// few more bits right next to multiples of pi.
+namespace builtins {
+
+enum Id : size_t { SQRT = 0, SIN, EXP, LOG, FLOOR, ABS, NUM_BUILTINS };
+
+inline constexpr std::string_view NAMES[NUM_BUILTINS] = {
+    "sqrt", "sin", "exp", "log", "floor", "abs"};
+
+inline std::optional<Id> Find(std::string_view name) {
+  for (size_t id = 0; id < NUM_BUILTINS; ++id) {
+    if (NAMES[id] == name) {
+      return static_cast<Id>(id);
+    }
+  }
+  return std::nullopt;
+}
+
+MC_KERNEL_OPTIONS_BEGIN
+
+namespace detail {
+
+// std::bit_cast is built with the default FP options, and GCC won't inline
+// it into code built with others
+template <typename To, typename From>
+[[gnu::always_inline]] inline To BitCast(From from) {
+  return __builtin_bit_cast(To, from);
+}
+
+// adding then subtracting 1.5 * 2^52 rounds to the nearest integer, and
+// leaves that integer in the low bits of the sum
+inline constexpr double SHIFT = 0x1.8p52;
+
+// 2^k for a whole k with -1022 <= k <= 1023
+[[gnu::always_inline]] inline double Pow2(double k) {
+  uint64_t bits = BitCast<uint64_t>(k + SHIFT);
+  return BitCast<double>((bits + 1023) << 52);
+}
+
+// ln 2 split so that k * LN2_HI is exact for |k| < 2^11
+inline constexpr double LN2_HI = 6.93147180369123816490e-01;
+inline constexpr double LN2_LO = 1.90821492927058770002e-10;
+inline constexpr double INV_LN2 = 1.44269504088896338700e+00;
+
+// e^x = 2^k * e^r with |r| <= ln2/2; e^r by its Taylor series to r^13.
+// 2^k is applied in two halves so results near the overflow and underflow
+// limits (and subnormal results) come out right.
+[[gnu::always_inline]] inline double Exp(double x) {
+  double clamped = x < -746.0 ? -746.0 : x;
+  clamped = clamped > 710.0 ? 710.0 : clamped;
+  double k = (clamped * INV_LN2 + SHIFT) - SHIFT;
+  double r = (clamped - k * LN2_HI) - k * LN2_LO;
+  double p = 1.0 / 6227020800.0; // 1/13!
+  p = 1.0 / 479001600.0 + r * p;
+  p = 1.0 / 39916800.0 + r * p;
+  p = 1.0 / 3628800.0 + r * p;
+  p = 1.0 / 362880.0 + r * p;
+  p = 1.0 / 40320.0 + r * p;
+  p = 1.0 / 5040.0 + r * p;
+  p = 1.0 / 720.0 + r * p;
+  p = 1.0 / 120.0 + r * p;
+  p = 1.0 / 24.0 + r * p;
+  p = 1.0 / 6.0 + r * p;
+  p = 0.5 + r * p;
+  p = 1.0 + r * p;
+  p = 1.0 + r * p;
+  double half = (k * 0.5 + SHIFT) - SHIFT;
+  return p * Pow2(half) * Pow2(k - half);
+}
+
+// x = 2^e * m with sqrt(1/2) <= m < sqrt(2); log(m) = 2 atanh(s) with
+// s = (m - 1) / (m + 1), by its series to s^23
+[[gnu::always_inline]] inline double Log(double x) {
+  bool tiny = x < 0x1p-1022; // subnormals are scaled up first
+  double scaled = tiny ? x * 0x1p54 : x;
+  uint64_t bits = BitCast<uint64_t>(scaled);
+  double e = BitCast<double>(0x4330000000000000ull | (bits >> 52)) -
+             0x1p52 - 1023.0;
+  e = tiny ? e - 54.0 : e;
+  double m = BitCast<double>((bits & 0x000fffffffffffffull) |
+                                   0x3ff0000000000000ull);
+  bool high = m > 1.41421356237309504880;
+  m = high ? m * 0.5 : m;
+  e = high ? e + 1.0 : e;
+  double f = m - 1.0;
+  double s = f / (2.0 + f);
+  double z = s * s;
+  double q = 1.0 / 23.0;
+  q = 1.0 / 21.0 + z * q;
+  q = 1.0 / 19.0 + z * q;
+  q = 1.0 / 17.0 + z * q;
+  q = 1.0 / 15.0 + z * q;
+  q = 1.0 / 13.0 + z * q;
+  q = 1.0 / 11.0 + z * q;
+  q = 1.0 / 9.0 + z * q;
+  q = 1.0 / 7.0 + z * q;
+  q = 1.0 / 5.0 + z * q;
+  q = 1.0 / 3.0 + z * q;
+  double two_s = 2.0 * s;
+  double log_m = two_s + two_s * (z * q);
+  double result = e * LN2_HI + (e * LN2_LO + log_m);
+  constexpr double INF = std::numeric_limits<double>::infinity();
+  // negative and NaN inputs fall through to NaN
+  return x > 0 && x < INF ? result
+         : x == 0         ? -INF
+         : x == INF       ? INF
+                          : std::numeric_limits<double>::quiet_NaN();
+}
+
+// Beyond this, reducing by pi/2 in three pieces loses accuracy, so sin
+// falls back to the C library (in both forms).
+inline constexpr double SIN_LIMIT = 1e5;
+
+// x = n * pi/2 + y with |y| <= pi/4 (pi/2 in three 33-bit pieces, so each
+// n * piece is exact); then sin or cos of y by Taylor series, by quadrant
+[[gnu::always_inline]] inline double SinReduced(double x) {
+  constexpr double TWO_OVER_PI = 6.36619772367581382433e-01;
+  constexpr double PIO2_1 = 1.57079632673412561417e+00;
+  constexpr double PIO2_2 = 6.07710050630396597660e-11;
+  constexpr double PIO2_3 = 2.02226624871116645580e-21;
+  double shifted = x * TWO_OVER_PI + SHIFT;
+  uint64_t quadrant = BitCast<uint64_t>(shifted) & 3;
+  double n = shifted - SHIFT;
+  double y = ((x - n * PIO2_1) - n * PIO2_2) - n * PIO2_3;
+  double z = y * y;
+
+  double s = 1.0 / 355687428096000.0; // 1/17!
+  s = -1.0 / 1307674368000.0 + z * s;
+  s = 1.0 / 6227020800.0 + z * s;
+  s = -1.0 / 39916800.0 + z * s;
+  s = 1.0 / 362880.0 + z * s;
+  s = -1.0 / 5040.0 + z * s;
+  s = 1.0 / 120.0 + z * s;
+  s = -1.0 / 6.0 + z * s;
+  double sin_y = y + y * (z * s);
+
+  double c = 1.0 / 20922789888000.0; // 1/16!
+  c = -1.0 / 87178291200.0 + z * c;
+  c = 1.0 / 479001600.0 + z * c;
+  c = -1.0 / 3628800.0 + z * c;
+  c = 1.0 / 40320.0 + z * c;
+  c = -1.0 / 720.0 + z * c;
+  c = 1.0 / 24.0 + z * c;
+  c = -0.5 + z * c;
+  double cos_y = 1.0 + z * c;
+
+  double magnitude = (quadrant & 1) ? cos_y : sin_y;
+  return (quadrant & 2) ? -magnitude : magnitude;
+}
+
+[[gnu::always_inline]] inline bool SinInRange(double x) {
+  return std::fabs(x) <= SIN_LIMIT;
+}
+
+} // namespace detail
+
+inline double Sin(double x) {
+  return detail::SinInRange(x) ? detail::SinReduced(x) : std::sin(x);
+}
+
+inline double Scalar(Id id, double x) {
+  switch (id) {
+  case SQRT:
+    return std::sqrt(x);
+  case SIN:
+    return Sin(x);
+  case EXP:
+    return detail::Exp(x);
+  case LOG:
+    return detail::Log(x);
+  case FLOOR:
+    return std::floor(x);
+  default:
+    return std::fabs(x);
+  }
+}
+
+// out[i] = f(in[i]) for a block; out may not alias in
+MC_KERNEL inline void SqrtBatch(double *__restrict out, double const *__restrict in,
+                                size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = std::sqrt(in[i]);
+  }
+}
+
+MC_KERNEL inline void SinBatch(double *__restrict out, double const *__restrict in,
+                               size_t n) {
+  uint64_t out_of_range = 0;
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = detail::SinReduced(in[i]);
+    out_of_range += !detail::SinInRange(in[i]);
+  }
+  if (out_of_range) {
+    for (size_t i = 0; i < n; ++i) {
+      if (!detail::SinInRange(in[i])) {
+        out[i] = std::sin(in[i]);
+      }
+    }
+  }
+}
+
+MC_KERNEL inline void ExpBatch(double *__restrict out, double const *__restrict in,
+                               size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = detail::Exp(in[i]);
+  }
+}
+
+MC_KERNEL inline void LogBatch(double *__restrict out, double const *__restrict in,
+                               size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = detail::Log(in[i]);
+  }
+}
+
+MC_KERNEL inline void FloorBatch(double *__restrict out,
+                                 double const *__restrict in, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = std::floor(in[i]);
+  }
+}
+
+MC_KERNEL inline void AbsBatch(double *__restrict out, double const *__restrict in,
+                               size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = std::fabs(in[i]);
+  }
+}
+
+inline void Batch(Id id, double *out, double const *in, size_t n) {
+  switch (id) {
+  case SQRT:
+    SqrtBatch(out, in, n);
+    break;
+  case SIN:
+    SinBatch(out, in, n);
+    break;
+  case EXP:
+    ExpBatch(out, in, n);
+    break;
+  case LOG:
+    LogBatch(out, in, n);
+    break;
+  case FLOOR:
+    FloorBatch(out, in, n);
+    break;
+  default:
+    AbsBatch(out, in, n);
+    break;
+  }
+}
+
+MC_KERNEL_OPTIONS_END
+
+} // namespace builtins
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "Error.hpp"
+#include "SymbolTable.hpp"
+
+// Saves and restores a run partway through, so a long script that gets
+// killed can pick up from its last checkpoint instead of starting over.
+//
+// A checkpoint is taken right before a statement inside a SCOPE is
+// dispatched. At that point the whole execution position is the list of
+// child indices leading from the root down to that statement (plus the end
+// bound of any FOR we're inside), which, together with every variable's
+// value and initialized flag, is enough to re-enter the tree at the same
+// spot. Parallel for bodies run on other threads, which never see the
+// checkpointer, so they are only ever resumed as a whole.
+//
+// File layout (native endianness, it's meant to be restored on the same
+// machine):
+//   "MCCK" u32 version, u64 source hash, u64 steps, u64 output bytes,
+//   u64 variable count, then (f64 value, u8 initialized) per variable,
+//   each followed by its elements (f64 each) if it's an array, then u64
+//   frame count and (u64 index, f64 loop end) per frame.
+// Version 2 added the array elements; other versions are refused.
+class Checkpointer {
+public:
+  struct Frame {
+    uint64_t index{};
+    double loop_end{};
+  };
+
+private:
+  static constexpr char MAGIC[4] = {'M', 'C', 'C', 'K'};
+  static constexpr uint32_t VERSION = 2;
+
+  std::string path{};
+  uint64_t every{};
+  uint64_t source_hash{};
+
+  uint64_t steps = 0;
+  uint64_t output_bytes = 0;
+  std::vector<Frame> position{};
+
+  // frames still to be consumed on the way back down after a restore
+  std::vector<Frame> resume{};
+  size_t resume_idx = 0;
+
+  template <typename T> static void Put(std::string &out, T value) {
+    out.append(reinterpret_cast<char const *>(&value), sizeof(T));
+  }
+
+  template <typename T> static T Take(std::string_view &in) {
+    if (in.size() < sizeof(T)) {
+      ErrorNoLine("Checkpoint file is truncated");
+    }
+    T value{};
+    std::copy_n(in.data(), sizeof(T), reinterpret_cast<char *>(&value));
+    in.remove_prefix(sizeof(T));
+    return value;
+  }
+
+  // write next to the target and rename over it, so a crash mid-write
+  // leaves the previous checkpoint intact
+  void Write(SymbolTable const &symbols) const {
+    std::string out{MAGIC, sizeof(MAGIC)};
+    Put(out, VERSION);
+    Put(out, source_hash);
+    Put(out, steps);
+    Put(out, output_bytes);
+    Put<uint64_t>(out, symbols.NumVars());
+    for (size_t var_id = 0; var_id < symbols.NumVars(); ++var_id) {
+      Put(out, symbols.GetRawValue(var_id));
+      Put<uint8_t>(out, symbols.IsInitialized(var_id));
+      AlignedArray const &elements = symbols.GetArray(var_id);
+      out.append(reinterpret_cast<char const *>(elements.Data()),
+                 elements.Length() * sizeof(double));
+    }
+    Put<uint64_t>(out, position.size());
+    for (Frame const &frame : position) {
+      Put(out, frame.index);
+      Put(out, frame.loop_end);
+    }
+
+    std::string tmp_path = path + ".tmp";
+    FILE *file = std::fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+      ErrorNoLine("Unable to write checkpoint '", tmp_path, "'.");
+    }
+    bool ok = std::fwrite(out.data(), 1, out.size(), file) == out.size();
+    ok = std::fflush(file) == 0 && ok;
+    ok = fsync(fileno(file)) == 0 && ok;
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+      ErrorNoLine("Unable to write checkpoint '", path, "'.");
+    }
+  }
+
+public:
+  // every == 0 only restores, without taking new checkpoints
+  Checkpointer(std::string path, uint64_t every, std::string_view source)
+      : path(path), every(every), source_hash(Hash(source)) {}
+
+  // FNV-1a
+  static uint64_t Hash(std::string_view data) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : data) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  void Restore(std::string const &restore_path, SymbolTable &symbols) {
+    std::ifstream file(restore_path, std::ios::binary);
+    if (file.fail()) {
+      ErrorNoLine("Unable to open checkpoint '", restore_path, "'.");
+    }
+    std::string data(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>{});
+    std::string_view in = data;
+
+    if (in.substr(0, sizeof(MAGIC)) != std::string_view{MAGIC, sizeof(MAGIC)}) {
+      ErrorNoLine("'", restore_path, "' is not a checkpoint file");
+    }
+    in.remove_prefix(sizeof(MAGIC));
+    if (Take<uint32_t>(in) != VERSION) {
+      ErrorNoLine("Unsupported checkpoint version in '", restore_path, "'");
+    }
+    if (Take<uint64_t>(in) != source_hash) {
+      ErrorNoLine("Checkpoint '", restore_path,
+                  "' was taken from a different source file");
+    }
+    // the statement we stopped in front of is counted again when it gets
+    // dispatched on the way back in
+    steps = Take<uint64_t>(in) - 1;
+    output_bytes = Take<uint64_t>(in);
+    if (Take<uint64_t>(in) != symbols.NumVars()) {
+      ErrorNoLine("Checkpoint '", restore_path,
+                  "' does not match this program's variables");
+    }
+    for (size_t var_id = 0; var_id < symbols.NumVars(); ++var_id) {
+      double value = Take<double>(in);
+      symbols.RestoreValue(var_id, value, Take<uint8_t>(in));
+      // lengths are part of the program, so they already match
+      AlignedArray &elements = symbols.GetArray(var_id);
+      for (size_t i = 0; i < elements.Length(); ++i) {
+        elements[i] = Take<double>(in);
+      }
+    }
+    resume.resize(Take<uint64_t>(in));
+    for (Frame &frame : resume) {
+      frame.index = Take<uint64_t>(in);
+      frame.loop_end = Take<double>(in);
+    }
+    resume_idx = 0;
+  }
+
+  // Output already produced by the killed run is cut back to what had been
+  // written at checkpoint time (stdout must be a regular file opened for
+  // appending, ex. `>> out.txt`, for the earlier output to survive).
+  void RestoreOutput() const {
+    struct stat info{};
+    if (fstat(STDOUT_FILENO, &info) != 0 || !S_ISREG(info.st_mode) ||
+        static_cast<uint64_t>(info.st_size) < output_bytes) {
+      return;
+    }
+    if (ftruncate(STDOUT_FILENO, static_cast<off_t>(output_bytes)) != 0 ||
+        lseek(STDOUT_FILENO, static_cast<off_t>(output_bytes), SEEK_SET) < 0) {
+      ErrorNoLine("Unable to rewind output to checkpoint");
+    }
+  }
+
+  bool Resuming() const { return resume_idx < resume.size(); }
+
+  Frame NextResumeFrame() { return resume.at(resume_idx++); }
+
+  void PushFrame(Frame frame) { position.push_back(frame); }
+  void PopFrame() { position.pop_back(); }
+
+  // called with the statement's frame already pushed; statements passed
+  // through on the way back down after a restore don't count
+  void Step(SymbolTable const &symbols) {
+    if (Resuming()) {
+      return;
+    }
+    ++steps;
+    if (every && steps % every == 0) {
+      Write(symbols);
+    }
+  }
+
+  void CountOutput(size_t bytes) { output_bytes += bytes; }
+};
+
+// Only set on the main thread; see the note above.
+inline thread_local Checkpointer *checkpointer = nullptr;
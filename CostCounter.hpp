@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+// Abstract work counters for --cost. Unlike times they don't depend on the
+// machine or how busy it is, so tests can check them exactly: a change that
+// makes the interpreter do more work for the same script shows up as a diff
+// in tests/expected/cost-*.txt.
+struct CostCounter {
+  uint64_t dispatches = 0; // nodes run
+  uint64_t reads = 0;      // symbol table reads
+  uint64_t writes = 0;     // symbol table writes
+  uint64_t arithmetic = 0; // operators applied, loop steps, reductions
+  uint64_t formatted_bytes = 0;
+  uint64_t memo_hits = 0;      // pure calls answered from the memo cache
+  uint64_t memo_misses = 0;    // pure calls that ran the body
+  uint64_t memo_evictions = 0; // results that replaced a colliding entry
+
+  CostCounter &operator+=(CostCounter const &other) {
+    dispatches += other.dispatches;
+    reads += other.reads;
+    writes += other.writes;
+    arithmetic += other.arithmetic;
+    formatted_bytes += other.formatted_bytes;
+    memo_hits += other.memo_hits;
+    memo_misses += other.memo_misses;
+    memo_evictions += other.memo_evictions;
+    return *this;
+  }
+
+  void Report(std::ostream &out) const {
+    out << std::left << std::setw(20) << "dispatches" << dispatches << '\n'
+        << std::setw(20) << "symbol reads" << reads << '\n'
+        << std::setw(20) << "symbol writes" << writes << '\n'
+        << std::setw(20) << "arithmetic ops" << arithmetic << '\n'
+        << std::setw(20) << "formatted bytes" << formatted_bytes << '\n';
+    // only scripts that call a pure function use the memo cache
+    if (memo_hits || memo_misses) {
+      out << std::setw(20) << "memo hits" << memo_hits << '\n'
+          << std::setw(20) << "memo misses" << memo_misses << '\n'
+          << std::setw(20) << "memo evictions" << memo_evictions << '\n';
+    }
+    out << std::right << std::flush;
+  }
+};
+
+// Parallel for workers get their own counter, added back in when they join,
+// so the totals don't depend on the number of threads.
+inline thread_local CostCounter *cost_counter = nullptr;
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <iomanip>
+#include <optional>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "ASTNode.hpp"
+#include "SymbolTable.hpp"
+
+// Static estimate of how much work a parsed script will do, from an abstract
+// interpretation of its AST before anything runs: statements are counted
+// once per estimated execution, so each one is weighted by the trip counts
+// of the loops around it. Trip counts come from for-loop bounds that are
+// constants, or variables holding a known constant at that point, and from
+// WHILE loops whose condition is known to be 0 or whose body ends by
+// setting it to 0 (with nothing after that writing it). Any other loop is assumed to run UNBOUNDED_TRIPS times
+// and marks the script unbounded. A call costs one run of the function's
+// body (estimated once per function); recursion can't be bounded.
+//
+// Batch mode uses the class to route heavy scripts to their own workers;
+// --estimate prints the whole thing.
+struct CostEstimate {
+  enum Class { FAST = 0, MEDIUM, HEAVY, NUM_CLASSES };
+
+  static constexpr double UNBOUNDED_TRIPS = 1000;
+  static constexpr double MEDIUM_STATEMENTS = 1e4;
+  static constexpr double HEAVY_STATEMENTS = 1e6;
+  // prints cost far more than other statements (formatting and I/O)
+  static constexpr double MEDIUM_PRINTS = 1e3;
+  static constexpr double HEAVY_PRINTS = 1e5;
+  static constexpr size_t MEDIUM_DEPTH = 3;
+  static constexpr size_t MEDIUM_BYTES = 64 * 1024;
+
+  double statements = 0; // statements executed
+  double prints = 0;     // prints executed
+  size_t loop_depth = 0; // deepest loop nesting
+  size_t source_bytes = 0;
+  bool unbounded = false; // some loop's trip count couldn't be bounded
+
+  Class Classify() const {
+    if (unbounded || statements >= HEAVY_STATEMENTS || prints >= HEAVY_PRINTS) {
+      return HEAVY;
+    }
+    if (statements >= MEDIUM_STATEMENTS || prints >= MEDIUM_PRINTS ||
+        loop_depth >= MEDIUM_DEPTH || source_bytes >= MEDIUM_BYTES) {
+      return MEDIUM;
+    }
+    return FAST;
+  }
+
+  static char const *ClassName(Class cost_class) {
+    switch (cost_class) {
+    case FAST:
+      return "fast";
+    case MEDIUM:
+      return "medium";
+    default:
+      return "heavy";
+    }
+  }
+
+  void Report(std::ostream &out) const {
+    out << std::left << std::setw(20) << "estimated class"
+        << ClassName(Classify()) << '\n'
+        << std::setw(20) << "statements" << statements
+        << (unbounded ? " (unbounded)" : "") << '\n'
+        << std::setw(20) << "prints" << prints << '\n'
+        << std::setw(20) << "loop depth" << loop_depth << '\n'
+        << std::setw(20) << "source bytes" << source_bytes << '\n'
+        << std::right << std::flush;
+  }
+};
+
+class CostEstimator {
+private:
+  SymbolTable const &table;
+  // variables known to hold a constant at the current point
+  std::unordered_map<size_t, double> constants{};
+  double multiplier = 1; // product of the enclosing loops' trip counts
+  size_t depth = 0;
+  CostEstimate estimate{};
+  // one call of each function, and the functions being estimated now
+  std::unordered_map<size_t, CostEstimate> function_costs{};
+  std::vector<size_t> active{};
+
+  CostEstimator(SymbolTable const &table) : table(table) {}
+
+  std::optional<double> Constant(ASTNode const &expr) const {
+    if (expr.type == ASTNode::NUMBER) {
+      return expr.value;
+    }
+    if (expr.type == ASTNode::IDENTIFIER) {
+      if (auto found = constants.find(expr.var_id); found != constants.end()) {
+        return found->second;
+      }
+    }
+    return std::nullopt;
+  }
+
+  // anything a loop body writes is unknown inside the loop and after it
+  void ForgetWrites(ASTNode const &node) {
+    if (node.type == ASTNode::ASSIGN || node.type == ASTNode::FOR) {
+      constants.erase(node.GetChild(0).var_id);
+    }
+    if (node.type == ASTNode::CALL) {
+      for (size_t var_id : table.GetFunction(node.var_id).global_writes) {
+        constants.erase(var_id);
+      }
+    }
+    for (size_t i = 0; i < node.NumChildren(); ++i) {
+      ForgetWrites(node.GetChild(i));
+    }
+  }
+
+  static bool IsClearing(ASTNode const &statement, size_t var_id) {
+    if (statement.type != ASTNode::ASSIGN ||
+        statement.GetChild(0).type != ASTNode::IDENTIFIER ||
+        statement.GetChild(0).var_id != var_id) {
+      return false;
+    }
+    ASTNode const &value = statement.GetChild(1);
+    return value.type == ASTNode::NUMBER && value.value == 0;
+  }
+
+  // true if `body` ends by setting `var_id` to 0: a top-level assignment of
+  // 0 that nothing after it can overwrite (in nested scopes, loops or the
+  // functions it calls either), so a WHILE on it can't go round more than
+  // once
+  bool EndsByClearing(ASTNode const &body, size_t var_id) const {
+    if (body.type != ASTNode::SCOPE) {
+      return IsClearing(body, var_id);
+    }
+    for (size_t i = body.NumChildren(); i-- > 0;) {
+      ASTNode const &child = body.GetChild(i);
+      if (IsClearing(child, var_id)) {
+        return true;
+      }
+      std::vector<size_t> written{};
+      child.CollectWrites(written, table);
+      if (std::find(written.begin(), written.end(), var_id) != written.end()) {
+        return false;
+      }
+    }
+    return false;
+  }
+
+  double WhileTrips(ASTNode const &node) const {
+    ASTNode const &condition = node.GetChild(0);
+    if (std::optional<double> value = Constant(condition); value && *value == 0) {
+      return 0;
+    }
+    if (condition.type == ASTNode::IDENTIFIER &&
+        EndsByClearing(node.GetChild(1), condition.var_id)) {
+      return 1;
+    }
+    return -1;
+  }
+
+  double ForTrips(ASTNode const &node) const {
+    std::optional<double> start = Constant(node.GetChild(1));
+    std::optional<double> end = Constant(node.GetChild(2));
+    if (!start || !end) {
+      return -1;
+    }
+    return std::max(0.0, std::ceil(*end - *start));
+  }
+
+  // the body is estimated on its own, knowing nothing about the arguments
+  CostEstimate FunctionCost(size_t id) {
+    if (auto found = function_costs.find(id); found != function_costs.end()) {
+      return found->second;
+    }
+    if (std::find(active.begin(), active.end(), id) != active.end()) {
+      CostEstimate recursive{};
+      recursive.unbounded = true;
+      return recursive;
+    }
+    active.push_back(id);
+    auto outer_constants = std::move(constants);
+    double outer_multiplier = multiplier;
+    size_t outer_depth = depth;
+    CostEstimate outer_estimate = estimate;
+    constants = {};
+    multiplier = 1;
+    depth = 0;
+    estimate = {};
+    Visit(*table.GetFunction(id).body);
+    CostEstimate cost = estimate;
+    constants = std::move(outer_constants);
+    multiplier = outer_multiplier;
+    depth = outer_depth;
+    estimate = outer_estimate;
+    active.pop_back();
+    function_costs[id] = cost;
+    return cost;
+  }
+
+  // expressions only cost anything through the calls in them
+  void VisitExpr(ASTNode const &expr) {
+    for (size_t i = 0; i < expr.NumChildren(); ++i) {
+      VisitExpr(expr.GetChild(i));
+    }
+    if (expr.type != ASTNode::CALL) {
+      return;
+    }
+    CostEstimate cost = FunctionCost(expr.var_id);
+    estimate.statements += multiplier * cost.statements;
+    estimate.prints += multiplier * cost.prints;
+    estimate.loop_depth = std::max(estimate.loop_depth, depth + cost.loop_depth);
+    estimate.unbounded = estimate.unbounded || (cost.unbounded && multiplier > 0);
+    ForgetWrites(expr);
+  }
+
+  // trips < 0 means unknown
+  void VisitLoop(ASTNode const &body, double trips) {
+    if (trips < 0) {
+      estimate.unbounded = estimate.unbounded || multiplier > 0;
+      trips = CostEstimate::UNBOUNDED_TRIPS;
+    }
+    ForgetWrites(body);
+    double outer = multiplier;
+    multiplier *= trips;
+    ++depth;
+    estimate.loop_depth = std::max(estimate.loop_depth, depth);
+    Visit(body);
+    --depth;
+    multiplier = outer;
+    ForgetWrites(body);
+  }
+
+  void Visit(ASTNode const &node) {
+    if (node.IsStatement()) {
+      estimate.statements += multiplier;
+    }
+    switch (node.type) {
+    case ASTNode::SCOPE:
+      for (size_t i = 0; i < node.NumChildren(); ++i) {
+        Visit(node.GetChild(i));
+      }
+      break;
+    case ASTNode::ASSIGN: {
+      VisitExpr(node);
+      size_t target = node.GetChild(0).var_id;
+      if (!node.literal.empty()) {
+        // a whole-array assignment costs about a statement per block
+        estimate.statements += multiplier * static_cast<double>(
+            table.Length(target) / kernels::BLOCK);
+      } else if (node.GetChild(0).type == ASTNode::INDEX) {
+        // arrays are never tracked as constants
+      } else if (std::optional<double> value = Constant(node.GetChild(1))) {
+        constants[target] = *value;
+      } else {
+        constants.erase(target);
+      }
+      break;
+    }
+    case ASTNode::PRINT:
+      estimate.prints += multiplier;
+      VisitExpr(node);
+      break;
+    case ASTNode::CALL:
+    case ASTNode::RETURN:
+      VisitExpr(node);
+      break;
+    case ASTNode::WHILE: {
+      VisitExpr(node.GetChild(0));
+      double trips = WhileTrips(node);
+      if (node.GetChild(0).type == ASTNode::IDENTIFIER) {
+        constants.erase(node.GetChild(0).var_id);
+      }
+      VisitLoop(node.GetChild(1), trips);
+      break;
+    }
+    case ASTNode::FOR: {
+      VisitExpr(node.GetChild(1));
+      VisitExpr(node.GetChild(2));
+      double trips = ForTrips(node);
+      constants.erase(node.GetChild(0).var_id);
+      VisitLoop(node.GetChild(node.NumChildren() - 1), trips);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+public:
+  static CostEstimate Estimate(ASTNode const &root, SymbolTable const &table,
+                               size_t source_bytes) {
+    CostEstimator estimator{table};
+    estimator.estimate.source_bytes = source_bytes;
+    estimator.Visit(root);
+    return estimator.estimate;
+  }
+};
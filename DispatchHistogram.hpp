@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Error.hpp"
+
+// Counts the node types ASTNode::Run dispatches, one at a time, in pairs
+// and in triples (each node with the one or two dispatched just before it),
+// for --dispatch-histogram. Common pairs and triples are the candidates for
+// fused nodes or superinstructions.
+//
+// The output file is merged into rather than overwritten, so running every
+// script of a corpus with the same path builds one histogram for all of
+// them. Lines are `<n-gram><TAB><count><TAB><percent of its order>`, e.g.
+// `identifier>assign	1200	31.4`, sorted by count within each order.
+class DispatchHistogram {
+public:
+  // ASTNode::NUM_TYPES, which this header can't see (ASTNode.hpp includes
+  // it); ASTNode.hpp checks that they agree
+  static constexpr size_t NUM_KINDS = 16;
+
+private:
+  std::array<uint64_t, NUM_KINDS> singles{};
+  std::array<uint64_t, NUM_KINDS * NUM_KINDS> pairs{};
+  std::array<uint64_t, NUM_KINDS * NUM_KINDS * NUM_KINDS> triples{};
+  // the last two kinds dispatched, NUM_KINDS until there are that many
+  size_t prev = NUM_KINDS;
+  size_t prev2 = NUM_KINDS;
+
+public:
+  void Record(size_t kind) {
+    kind = std::min(kind, NUM_KINDS - 1);
+    ++singles[kind];
+    if (prev < NUM_KINDS) {
+      ++pairs[prev * NUM_KINDS + kind];
+      if (prev2 < NUM_KINDS) {
+        ++triples[(prev2 * NUM_KINDS + prev) * NUM_KINDS + kind];
+      }
+    }
+    prev2 = prev;
+    prev = kind;
+  }
+
+  // sequences in separate threads are counted but never joined up
+  void Merge(DispatchHistogram const &other) {
+    for (size_t i = 0; i < singles.size(); ++i) {
+      singles[i] += other.singles[i];
+    }
+    for (size_t i = 0; i < pairs.size(); ++i) {
+      pairs[i] += other.pairs[i];
+    }
+    for (size_t i = 0; i < triples.size(); ++i) {
+      triples[i] += other.triples[i];
+    }
+  }
+
+  // kind_name is ASTNode::TypeName; passed in so this header doesn't need
+  // the AST
+  void Write(std::string const &path, char const *(*kind_name)(int)) const {
+    auto name = [kind_name](size_t kind) {
+      return std::string{kind_name(static_cast<int>(kind))};
+    };
+
+    // n-gram -> count, starting from whatever earlier runs left
+    std::array<std::map<std::string, uint64_t>, 3> counts{};
+    std::ifstream previous(path);
+    std::string line;
+    while (std::getline(previous, line)) {
+      std::istringstream fields{line};
+      std::string gram;
+      uint64_t count = 0;
+      if (line.starts_with("#") || !(fields >> gram >> count)) {
+        continue;
+      }
+      size_t order = static_cast<size_t>(std::count(gram.begin(), gram.end(), '>'));
+      if (order < counts.size()) {
+        counts[order][gram] += count;
+      }
+    }
+
+    for (size_t a = 0; a < NUM_KINDS; ++a) {
+      if (singles[a]) {
+        counts[0][name(a)] += singles[a];
+      }
+      for (size_t b = 0; b < NUM_KINDS; ++b) {
+        if (uint64_t count = pairs[a * NUM_KINDS + b]) {
+          counts[1][name(a) + ">" + name(b)] += count;
+        }
+        for (size_t c = 0; c < NUM_KINDS; ++c) {
+          if (uint64_t count = triples[(a * NUM_KINDS + b) * NUM_KINDS + c]) {
+            counts[2][name(a) + ">" + name(b) + ">" + name(c)] += count;
+          }
+        }
+      }
+    }
+
+    // write next to the target and rename over it, so a run that dies
+    // mid-write doesn't lose the corpus collected so far
+    std::string tmp_path = path + ".tmp";
+    {
+      std::ofstream out(tmp_path);
+      if (out.fail()) {
+        ErrorNoLine("Unable to write dispatch histogram '", tmp_path, "'.");
+      }
+      char const *headings[] = {"# singles", "# pairs", "# triples"};
+      out << std::fixed << std::setprecision(1);
+      for (size_t order = 0; order < counts.size(); ++order) {
+        std::vector<std::pair<std::string, uint64_t>> sorted(
+            counts[order].begin(), counts[order].end());
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [](auto const &a, auto const &b) {
+                           return a.second > b.second;
+                         });
+        uint64_t total = 0;
+        for (auto const &[gram, count] : sorted) {
+          total += count;
+        }
+        out << headings[order] << '\n';
+        for (auto const &[gram, count] : sorted) {
+          out << gram << '\t' << count << '\t'
+              << 100.0 * static_cast<double>(count) / static_cast<double>(total)
+              << '\n';
+        }
+      }
+      if (out.fail()) {
+        ErrorNoLine("Unable to write dispatch histogram '", tmp_path, "'.");
+      }
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+      ErrorNoLine("Unable to write dispatch histogram '", path, "'.");
+    }
+  }
+};
+
+// Parallel for workers record into their own histograms, merged in when
+// they join.
+inline thread_local DispatchHistogram *dispatch_histogram = nullptr;
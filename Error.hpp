@@ -1,15 +1,37 @@
 #pragma once
+#include <iostream>
+#include <stdexcept>
+
 #include "lexer.hpp"
 
 using namespace emplex;
 
+// Thrown instead of exiting when throw_on_error is set, so an interactive
+// session can report a bad statement and keep going.
+struct ErrorException : public std::runtime_error {
+  ErrorException() : std::runtime_error("MacroCalc error") {}
+};
+
+// Per thread, so several scripts can run side by side in one process (see
+// tests/golden_runner.cpp), each with its own error handling and messages.
+inline thread_local bool throw_on_error = false;
+inline thread_local std::ostream *error_output = &std::cerr;
+
+// Message has already been printed by the time we get here
+[[noreturn]] inline void ErrorAbort() {
+  if (throw_on_error) {
+    throw ErrorException{};
+  }
+  exit(1);
+}
+
 // From WordLang Error
 template <typename... Ts>
 [[noreturn]] void Error(size_t line_num, Ts... message) {
-  std::cerr << "ERROR (line " << line_num << "): ";
-  (std::cerr << ... << message);
-  std::cerr << std::endl;
-  exit(1);
+  *error_output << "ERROR (line " << line_num << "): ";
+  (*error_output << ... << message);
+  *error_output << std::endl;
+  ErrorAbort();
 }
 
 template <typename... Ts>
@@ -20,24 +42,24 @@ template <typename... Ts>
 template <typename... Ts>
 [[noreturn]] void ErrorUnexpected(Token const &token,
                                   [[maybe_unused]] Ts... expected) {
-  std::cerr << "ERROR (line " << token.line_id << "): ";
-  std::cerr << "Unexpected token '" << token.lexeme << "'"
+  *error_output << "ERROR (line " << token.line_id << "): ";
+  *error_output << "Unexpected token '" << token.lexeme << "'"
             << " of type " << Lexer::TokenName(token) << std::endl;
   // adding constexpr here to silence compiler warning (and check at compile
   // time!) from https://stackoverflow.com/a/46474191/4678913
   if constexpr (sizeof...(expected) > 0) {
-    std::cerr << '\t' << "Expected token type(s): ";
-    (std::cerr << ... << Lexer::TokenName(expected));
-    std::cerr << std::endl;
+    *error_output << '\t' << "Expected token type(s): ";
+    (*error_output << ... << Lexer::TokenName(expected));
+    *error_output << std::endl;
   }
-  exit(1);
+  ErrorAbort();
 }
 
 template <typename... Ts> [[noreturn]] void ErrorNoLine(Ts... message) {
-  std::cerr << "ERROR: ";
-  (std::cerr << ... << message);
-  std::cerr << std::endl;
-  exit(1);
+  *error_output << "ERROR: ";
+  (*error_output << ... << message);
+  *error_output << std::endl;
+  ErrorAbort();
 }
 
 // TODO: add an "Unexpected token" error
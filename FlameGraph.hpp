@@ -0,0 +1,111 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Error.hpp"
+#include "lexer.hpp"
+
+// Collects time for --flamegraph by stack of enclosing blocks (scopes,
+// loops, conditionals), named like `while@L7`, and writes it in the folded
+// format flame graph tools read: one `main;while@L7;scope@L7 <ns>` line per
+// distinct stack, where the count is the time spent directly in that block.
+//
+// Stacks are kept as a tree keyed by the block's token, so entering a block
+// is a hash lookup rather than building a string.
+class FlameGraph {
+public:
+  using clock = std::chrono::steady_clock;
+
+private:
+  struct Node {
+    std::string label{};
+    size_t parent = 0;
+    std::unordered_map<emplex::Token const *, size_t> children{};
+    clock::duration self{};
+  };
+
+  struct Frame {
+    size_t node;
+    clock::time_point start;
+    clock::duration nested{};
+  };
+
+  std::vector<Node> nodes{Node{"main"}};
+  std::vector<Frame> stack{};
+
+  std::string Path(size_t node) const {
+    if (node == 0) {
+      return nodes[0].label;
+    }
+    return Path(nodes[node].parent) + ";" + nodes[node].label;
+  }
+
+public:
+  void Enter(emplex::Token const *token, char const *kind) {
+    size_t parent = stack.empty() ? 0 : stack.back().node;
+    size_t node = 0;
+    if (token) {
+      auto [it, inserted] = nodes[parent].children.try_emplace(token, nodes.size());
+      node = it->second;
+      if (inserted) {
+        nodes.push_back(
+            {std::string{kind} + "@L" + std::to_string(token->line_id), parent});
+      }
+    }
+    stack.push_back({node, clock::now()});
+  }
+
+  void Exit() {
+    Frame frame = stack.back();
+    stack.pop_back();
+    clock::duration elapsed = clock::now() - frame.start;
+    nodes[frame.node].self += elapsed - frame.nested;
+    if (!stack.empty()) {
+      stack.back().nested += elapsed;
+    }
+  }
+
+  // Times one block; does nothing if flame graphs are off.
+  class Timer {
+  private:
+    FlameGraph *graph;
+
+  public:
+    Timer(FlameGraph *graph, emplex::Token const *token, char const *kind)
+        : graph(graph) {
+      if (graph) {
+        graph->Enter(token, kind);
+      }
+    }
+    ~Timer() {
+      if (graph) {
+        graph->Exit();
+      }
+    }
+    Timer(Timer const &) = delete;
+    Timer &operator=(Timer const &) = delete;
+  };
+
+  void Write(std::string const &path) const {
+    std::ofstream out(path);
+    if (out.fail()) {
+      ErrorNoLine("Unable to write flame graph '", path, "'.");
+    }
+    for (size_t node = 0; node < nodes.size(); ++node) {
+      auto nanos =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(nodes[node].self);
+      if (nanos.count() > 0) {
+        out << Path(node) << ' ' << nanos.count() << '\n';
+      }
+    }
+  }
+};
+
+// Only set on the main thread: blocks inside a parallel for body don't get
+// stacks of their own, and the body's wall time counts as the loop's.
+inline thread_local FlameGraph *flamegraph = nullptr;
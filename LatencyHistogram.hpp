@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+
+// HDR-style latency histogram for --batch --latency. Buckets are
+// log-linear: every power of two is split into SUB_BUCKETS equal parts, so
+// any recorded value is off by at most 1/SUB_BUCKETS (about 3%) whether
+// it's a microsecond or a minute, in a fixed few KB. Values are nanoseconds.
+class LatencyHistogram {
+private:
+  static constexpr unsigned SUB_BITS = 5;
+  static constexpr uint64_t SUB_BUCKETS = uint64_t{1} << SUB_BITS;
+  // values below SUB_BUCKETS get exact buckets, then one row per power of two
+  static constexpr size_t NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+  std::array<uint64_t, NUM_BUCKETS> counts{};
+  uint64_t total = 0;
+  uint64_t max = 0;
+  double sum = 0;
+
+  static size_t Bucket(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+      return static_cast<size_t>(value);
+    }
+    unsigned top = static_cast<unsigned>(std::bit_width(value)) - 1;
+    unsigned shift = top - SUB_BITS;
+    uint64_t sub = (value >> shift) - SUB_BUCKETS;
+    return static_cast<size_t>((shift + 1) * SUB_BUCKETS + sub);
+  }
+
+  // largest value that lands in a bucket
+  static uint64_t BucketTop(size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+      return bucket;
+    }
+    uint64_t shift = bucket / SUB_BUCKETS - 1;
+    uint64_t sub = bucket % SUB_BUCKETS + SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+  }
+
+public:
+  void Record(uint64_t nanos) {
+    ++counts[Bucket(nanos)];
+    ++total;
+    max = std::max(max, nanos);
+    sum += static_cast<double>(nanos);
+  }
+
+  uint64_t Count() const { return total; }
+
+  // smallest bucket top with at least `percent` of values at or below it
+  uint64_t Percentile(double percent) const {
+    if (total == 0) {
+      return 0;
+    }
+    auto wanted = static_cast<uint64_t>(
+        std::max(1.0, percent / 100.0 * static_cast<double>(total) + 0.5));
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < NUM_BUCKETS; ++bucket) {
+      seen += counts[bucket];
+      if (seen >= wanted) {
+        return std::min(BucketTop(bucket), max);
+      }
+    }
+    return max;
+  }
+
+  // one row of the report, in milliseconds
+  void ReportRow(std::ostream &out, std::string const &name) const {
+    auto ms = [](uint64_t nanos) { return static_cast<double>(nanos) / 1e6; };
+    out << std::left << std::setw(10) << name << std::right << std::setw(8)
+        << total << std::fixed << std::setprecision(3) << std::setw(11)
+        << (total ? sum / static_cast<double>(total) / 1e6 : 0.0);
+    for (double percent : {50.0, 90.0, 99.0, 99.9}) {
+      out << std::setw(11) << ms(Percentile(percent));
+    }
+    out << std::setw(11) << ms(max) << std::defaultfloat << '\n';
+  }
+
+  static void ReportHeader(std::ostream &out) {
+    out << "latency ms   scripts       mean        p50        p90        p99"
+           "      p99.9        max\n";
+  }
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Error.hpp"
+
+// Live counters for a running script, published in a POSIX shared memory
+// segment named /macrocalc-<pid> so `mcstat <pid>` can watch them from
+// outside without attaching to the process.
+//
+// Only the interpreter's main thread writes. Statements and loop iterations
+// are counted in a thread-local LiveCounter and published every
+// LiveCounter::PUBLISH_EVERY of them, so a long loop moves the counters
+// without touching shared memory on every statement; each publish is a
+// relaxed load and store (no locked instruction). The reader may see
+// counters from slightly different moments, which is fine for monitoring.
+// Statements inside parallel for bodies run on worker threads and aren't
+// counted, but their iterations are added once the loop finishes.
+struct LiveStats {
+  static constexpr uint32_t MAGIC = 0x4d435354; // "MCST"
+  static constexpr uint32_t VERSION = 1;
+
+  uint32_t magic{};
+  uint32_t version{};
+  std::atomic<uint64_t> statements{};
+  std::atomic<uint64_t> loop_iterations{};
+  std::atomic<uint64_t> prints{};
+  std::atomic<uint64_t> bytes_written{};
+  std::atomic<uint64_t> current_line{};
+
+  static void Add(std::atomic<uint64_t> &counter, uint64_t amount = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount,
+                  std::memory_order_relaxed);
+  }
+
+  static void Set(std::atomic<uint64_t> &counter, uint64_t value) {
+    counter.store(value, std::memory_order_relaxed);
+  }
+
+  static std::string SegmentName(pid_t pid) {
+    return "/macrocalc-" + std::to_string(pid);
+  }
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "shared memory counters must be lock free");
+
+// Only set on the main thread; see the note above.
+inline thread_local LiveStats *live_stats = nullptr;
+
+// The interpreter's pending counts, published to live_stats in batches.
+class LiveCounter {
+public:
+  static constexpr uint64_t PUBLISH_EVERY = 4096;
+
+  void Statement(uint64_t line) {
+    ++statements;
+    current_line = line;
+    Tick();
+  }
+
+  void Iterations(uint64_t count = 1) {
+    loop_iterations += count;
+    Tick();
+  }
+
+  // also called when a script or REPL statement finishes, so the final
+  // counts are exact
+  void Publish() {
+    if (live_stats) {
+      LiveStats::Add(live_stats->statements, statements);
+      LiveStats::Add(live_stats->loop_iterations, loop_iterations);
+      if (statements) {
+        LiveStats::Set(live_stats->current_line, current_line);
+      }
+    }
+    statements = 0;
+    loop_iterations = 0;
+    pending = 0;
+  }
+
+private:
+  void Tick() {
+    if (++pending == PUBLISH_EVERY) {
+      Publish();
+    }
+  }
+
+  uint64_t statements = 0;
+  uint64_t loop_iterations = 0;
+  uint64_t current_line = 0;
+  uint64_t pending = 0;
+};
+
+inline thread_local LiveCounter live_counter{};
+
+// Creates this process's segment and points live_stats at it. The segment
+// is unlinked again at exit.
+inline void PublishLiveStats() {
+  static std::string name = LiveStats::SegmentName(getpid());
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0 || ftruncate(fd, sizeof(LiveStats)) != 0) {
+    ErrorNoLine("Unable to create shared memory segment '", name, "'.");
+  }
+  void *memory = mmap(nullptr, sizeof(LiveStats), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    ErrorNoLine("Unable to map shared memory segment '", name, "'.");
+  }
+  std::atexit([]() { shm_unlink(name.c_str()); });
+
+  live_stats = new (memory) LiveStats{};
+  live_stats->version = LiveStats::VERSION;
+  std::atomic_thread_fence(std::memory_order_release);
+  live_stats->magic = LiveStats::MAGIC;
+}
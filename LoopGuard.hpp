@@ -0,0 +1,78 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+#include "SymbolTable.hpp"
+
+// Catches WHILE loops that can never finish. Everything a loop can see is
+// either written by its body or fixed for the whole loop, so if the
+// variables the body writes ever come back to an earlier state, and nothing
+// was printed in between, the loop is in a cycle it will never leave.
+//
+// States are sampled every `every` back-edges and checked with Brent's
+// cycle detection, so each loop only keeps one saved state around no matter
+// how long it runs.
+class LoopGuard {
+private:
+  uint64_t every;
+  uint64_t prints = 0;
+
+public:
+  class Tracker {
+  private:
+    LoopGuard &guard;
+    std::vector<size_t> var_ids;
+    uint64_t iterations = 0;
+
+    std::vector<uint64_t> saved{};
+    std::vector<uint64_t> current{};
+    uint64_t saved_prints = 0;
+    uint64_t power = 1;
+    uint64_t lambda = 0;
+
+    // compare bit patterns so an unchanged NaN still counts as unchanged
+    void Snapshot(SymbolTable const &symbols) {
+      current.clear();
+      for (size_t var_id : var_ids) {
+        current.push_back(std::bit_cast<uint64_t>(symbols.GetRawValue(var_id)));
+        current.push_back(symbols.IsInitialized(var_id));
+        AlignedArray const &elements = symbols.GetArray(var_id);
+        for (size_t i = 0; i < elements.Length(); ++i) {
+          current.push_back(std::bit_cast<uint64_t>(elements[i]));
+        }
+      }
+    }
+
+  public:
+    Tracker(LoopGuard &guard, std::vector<size_t> var_ids)
+        : guard(guard), var_ids(var_ids) {}
+
+    // Called at each back-edge; true if the loop has provably repeated
+    bool Repeated(SymbolTable const &symbols) {
+      if (++iterations % guard.every != 0) {
+        return false;
+      }
+      Snapshot(symbols);
+      bool printed = guard.prints != saved_prints;
+      if (!printed && iterations > guard.every && current == saved) {
+        return true;
+      }
+      if (printed || ++lambda == power) {
+        std::swap(saved, current);
+        saved_prints = guard.prints;
+        power *= 2;
+        lambda = 0;
+      }
+      return false;
+    }
+  };
+
+  LoopGuard(uint64_t every) : every(every) {}
+
+  void CountPrint() { ++prints; }
+};
+
+// Only set on the main thread, like the other execution hooks.
+inline thread_local LoopGuard *loop_guard = nullptr;
@@ -0,0 +1,807 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "ASTNode.hpp"
+#include "Builtins.hpp"
+#include "Checkpoint.hpp"
+#include "CostEstimate.hpp"
+#include "Error.hpp"
+#include "LiveStats.hpp"
+#include "RunStats.hpp"
+#include "SymbolTable.hpp"
+#include "Trace.hpp"
+#include "lexer.hpp"
+#include "string_lexer.hpp"
+
+using namespace emplex;
+
+class MacroCalc {
+private:
+  std::vector<Token> tokens{};
+  emplex::Lexer lexer{};
+  SymbolTable table{};
+  size_t token_idx{0};
+  ASTNode root{ASTNode::SCOPE};
+  size_t source_bytes{0};
+  // function bodies, kept where the symbol table's pointers to them stay
+  // valid; REPL lines that define functions keep their tokens here too
+  std::deque<ASTNode> function_bodies{};
+  std::deque<std::vector<Token>> kept_tokens{};
+  // for loops being parsed whose bounds are constants, innermost last; an
+  // index that's one of their variables can skip the bounds check
+  struct LoopRange {
+    size_t var_id;
+    double start;
+    double end;
+  };
+  std::vector<LoopRange> loop_ranges{};
+
+  emplex2::StringLexer string_lexer{};
+
+  Token const &CurToken() const {
+    if (token_idx >= tokens.size())
+      ErrorNoLine("Unexpected EOF");
+    return tokens.at(token_idx);
+  }
+
+  Token const &ConsumeToken() {
+    if (token_idx >= tokens.size())
+      ErrorNoLine("Unexpected EOF");
+    MC_TRACEPOINT(token, tokens[token_idx].id, tokens[token_idx].line_id);
+    return tokens.at(token_idx++);
+  }
+
+  Token const &ExpectToken(int token) {
+    if (CurToken() == token) {
+      return ConsumeToken();
+    }
+    ErrorUnexpected(CurToken(), token);
+  }
+
+  // rose: C++ optionals can't hold references, grumble grumble
+  Token const *IfToken(int token) {
+    if (CurToken() == token) {
+      return &ConsumeToken();
+    }
+    return nullptr;
+  }
+
+  // contextual keywords (for, parallel, reduce, ...) aren't in the lexer, so
+  // they come through as plain tokens and we match on the lexeme instead
+  bool IsLexeme(int token, std::string const &lexeme) const {
+    return CurToken() == token && CurToken().lexeme == lexeme;
+  }
+
+  Token const *IfLexeme(int token, std::string const &lexeme) {
+    if (IsLexeme(token, lexeme)) {
+      return &ConsumeToken();
+    }
+    return nullptr;
+  }
+
+  Token const &ExpectLexeme(int token, std::string const &lexeme) {
+    if (IsLexeme(token, lexeme)) {
+      return ConsumeToken();
+    }
+    Error(CurToken(), "Expected '", lexeme, "' but found '",
+          CurToken().lexeme, "'");
+  }
+
+  bool NextIs(int token) const {
+    return token_idx + 1 < tokens.size() && tokens[token_idx + 1] == token;
+  }
+
+  bool NextIsLexeme(int token, std::string const &lexeme) const {
+    return token_idx + 1 < tokens.size() && tokens[token_idx + 1] == token &&
+           tokens[token_idx + 1].lexeme == lexeme;
+  }
+
+  ASTNode ParseScope() {
+    ASTNode scope{ASTNode::SCOPE};
+    scope.token = &ExpectToken(Lexer::ID_SCOPE_Start);
+    table.PushScope();
+    while (CurToken() != Lexer::ID_SCOPE_END) {
+      scope.AddChild(ParseStatement());
+    }
+    ConsumeToken();
+    table.PopScope();
+    return scope;
+  }
+
+  ASTNode ParseDecl() {
+    ExpectToken(Lexer::ID_VAR);
+    Token const &ident = ExpectToken(Lexer::ID_ID);
+    if (IsLexeme(Lexer::ID_UNKNOWN, "[")) {
+      return ParseArrayDecl(ident);
+    }
+    if (IfToken(Lexer::ID_ENDLINE)) {
+      table.AddVar(ident.lexeme, ident.line_id);
+      return ASTNode{};
+    }
+    ExpectToken(Lexer::ID_ASSIGN);
+
+    ASTNode expr = ParseExpr();
+    ExpectToken(Lexer::ID_ENDLINE);
+
+    // don't add until _after_ we possibly resolve idents in expression
+    // ex. var foo = foo should error if foo is undefined
+    size_t var_id = table.AddVar(ident.lexeme, ident.line_id);
+
+    ASTNode out = ASTNode{ASTNode::ASSIGN};
+    out.token = &ident;
+    out.AddChildren(ASTNode(ASTNode::IDENTIFIER, var_id, &ident), std::move(expr));
+
+    return out;
+  }
+
+  // var a[N]; or var a[N] = <array expression>; zeroed (or assigned) each
+  // time the declaration runs, like any other
+  ASTNode ParseArrayDecl(Token const &ident) {
+    ExpectLexeme(Lexer::ID_UNKNOWN, "[");
+    Token const &size = ExpectToken(Lexer::ID_NUMBER);
+    double length = std::stod(size.lexeme);
+    if (length < 1 || length != std::floor(length) ||
+        length > static_cast<double>(AlignedArray::MAX_LENGTH)) {
+      Error(size, "array length must be a whole number from 1 to ",
+            AlignedArray::MAX_LENGTH);
+    }
+    ExpectLexeme(Lexer::ID_UNKNOWN, "]");
+    // call frames only save and restore scalars
+    if (table.DefiningFunction()) {
+      Error(ident, "arrays may not be declared inside functions");
+    }
+    ASTNode value = IfToken(Lexer::ID_ASSIGN)
+                        ? ParseArrayExpr(static_cast<size_t>(length), ident.lexeme)
+                        : ASTNode{ASTNode::NUMBER, 0.0};
+    ExpectToken(Lexer::ID_ENDLINE);
+    size_t var_id = table.AddArray(ident.lexeme, ident.line_id,
+                                   static_cast<size_t>(length));
+    ASTNode out{ASTNode::ASSIGN, "array"};
+    out.token = &ident;
+    out.AddChildren(ASTNode(ASTNode::IDENTIFIER, var_id, &ident),
+                    std::move(value));
+    return out;
+  }
+
+  ASTNode ParseAssign() {
+    Token const &new_id = ExpectToken(Lexer::ID_ID);
+    ASTNode node = ASTNode{ASTNode::ASSIGN};
+    node.token = &new_id;
+    if (IsLexeme(Lexer::ID_UNKNOWN, "[")) {
+      ASTNode target = ParseIndex(new_id);
+      ExpectToken(Lexer::ID_ASSIGN);
+      node.AddChildren(std::move(target), ParseExpr());
+      ExpectToken(Lexer::ID_ENDLINE);
+      return node;
+    }
+    ExpectToken(Lexer::ID_ASSIGN);
+    size_t var_id = table.FindVar(new_id.lexeme, new_id.line_id);
+    ASTNode target{ASTNode::IDENTIFIER, var_id, &new_id};
+    if (table.IsArray(var_id)) {
+      node.literal = "array";
+      node.AddChildren(std::move(target),
+                       ParseArrayExpr(table.Length(var_id), new_id.lexeme));
+    } else {
+      node.AddChildren(std::move(target), ParseExpr());
+    }
+    ExpectToken(Lexer::ID_ENDLINE);
+    return node;
+  }
+
+  // names used as plain values; arrays only appear indexed, in len(), or in
+  // whole-array assignments
+  size_t FindScalar(std::string const &name, size_t line_num) const {
+    size_t var_id = table.FindVar(name, line_num);
+    if (table.IsArray(var_id)) {
+      Error(line_num, "array ", name, " used as a scalar");
+    }
+    return var_id;
+  }
+
+  size_t FindArray(Token const &name) const {
+    size_t var_id = table.FindVar(name.lexeme, name.line_id);
+    if (!table.IsArray(var_id)) {
+      Error(name, name.lexeme, " is not an array");
+    }
+    return var_id;
+  }
+
+  bool AtLexeme(int token, std::string const &lexeme) const {
+    return token_idx < tokens.size() && tokens[token_idx] == token &&
+           tokens[token_idx].lexeme == lexeme;
+  }
+
+  // name[expr], with the name already consumed. The bounds check is left
+  // out when the index is a constant in range, or the variable of an
+  // enclosing for loop whose constant bounds are inside the array (the body
+  // can't assign it, so it stays in range).
+  ASTNode ParseIndex(Token const &name) {
+    ASTNode node{ASTNode::INDEX, FindArray(name), &name};
+    ExpectLexeme(Lexer::ID_UNKNOWN, "[");
+    ASTNode index = ParseExpr();
+    ExpectLexeme(Lexer::ID_UNKNOWN, "]");
+    double length = static_cast<double>(table.Length(node.var_id));
+    bool in_bounds = false;
+    if (index.type == ASTNode::NUMBER) {
+      in_bounds = index.value == std::floor(index.value) && index.value >= 0 &&
+                  index.value < length;
+    } else if (index.type == ASTNode::IDENTIFIER) {
+      for (auto range = loop_ranges.rbegin(); range != loop_ranges.rend();
+           ++range) {
+        if (range->var_id == index.var_id) {
+          in_bounds = range->start >= 0 && range->end <= length;
+          break;
+        }
+      }
+    }
+    if (in_bounds) {
+      node.literal = "unchecked";
+    }
+    node.AddChild(std::move(index));
+    return node;
+  }
+
+  // sqrt(x) etc. are bound to their function here, never looked up by name
+  // while running
+  static ASTNode MakeBuiltin(Token const &name, builtins::Id id, ASTNode arg) {
+    ASTNode node{ASTNode::BUILTIN, static_cast<size_t>(id), &name};
+    node.AddChild(std::move(arg));
+    return node;
+  }
+
+  // len(a) is known while parsing, so it's just a number
+  ASTNode ParseLen() {
+    ExpectToken(Lexer::ID_OPEN_PARENTHESIS);
+    size_t var_id = FindArray(ExpectToken(Lexer::ID_ID));
+    ExpectToken(Lexer::ID_CLOSE_PARENTHESIS);
+    return ASTNode(ASTNode::NUMBER, static_cast<double>(table.Length(var_id)));
+  }
+
+  // Element-wise + - * / (usual precedence, left to right, parentheses)
+  // over arrays of `length` elements and scalar expressions, which are
+  // broadcast. Only parsed as the value of a whole-array assignment.
+  ASTNode ParseArrayExpr(size_t length, std::string const &target,
+                         int min_precedence = 1) {
+    return ParseArrayBinary(ParseArrayOperand(length, target), length, target,
+                            min_precedence);
+  }
+
+  int ArrayPrecedence() const {
+    if (CurToken() != Lexer::ID_MATH) {
+      return 0;
+    }
+    std::string const &op = CurToken().lexeme;
+    if (op == "+" || op == "-") {
+      return 1;
+    }
+    if (op == "*" || op == "/") {
+      return 2;
+    }
+    Error(CurToken(), "operator ", op, " is not supported on arrays");
+  }
+
+  ASTNode ParseArrayBinary(ASTNode lhs, size_t length, std::string const &target,
+                           int min_precedence) {
+    int precedence = ArrayPrecedence();
+    if (precedence < min_precedence || precedence == 0) {
+      return lhs;
+    }
+    Token const &op = ConsumeToken();
+    ASTNode rhs = ParseArrayBinary(ParseArrayOperand(length, target), length,
+                                   target, precedence + 1);
+    ASTNode node{ASTNode::ARRAY_OP, op.lexeme};
+    node.token = &op;
+    node.AddChildren(std::move(lhs), std::move(rhs));
+    return ParseArrayBinary(std::move(node), length, target, min_precedence);
+  }
+
+  ASTNode ParseArrayOperand(size_t length, std::string const &target) {
+    if (IfToken(Lexer::ID_OPEN_PARENTHESIS)) {
+      ASTNode inner = ParseArrayExpr(length, target);
+      ExpectToken(Lexer::ID_CLOSE_PARENTHESIS);
+      return inner;
+    }
+    // built-ins take array arguments here, and are applied element-wise
+    if (CurToken() == Lexer::ID_ID && NextIs(Lexer::ID_OPEN_PARENTHESIS)) {
+      if (std::optional<builtins::Id> id = builtins::Find(CurToken().lexeme)) {
+        Token const &name = ConsumeToken();
+        ExpectToken(Lexer::ID_OPEN_PARENTHESIS);
+        ASTNode arg = ParseArrayExpr(length, target);
+        ExpectToken(Lexer::ID_CLOSE_PARENTHESIS);
+        return MakeBuiltin(name, *id, std::move(arg));
+      }
+    }
+    if (CurToken() == Lexer::ID_ID && table.HasVar(CurToken().lexeme) &&
+        !NextIs(Lexer::ID_OPEN_PARENTHESIS) &&
+        !NextIsLexeme(Lexer::ID_UNKNOWN, "[")) {
+      Token const &name = CurToken();
+      size_t var_id = table.FindVar(name.lexeme, name.line_id);
+      if (table.IsArray(var_id)) {
+        ConsumeToken();
+        if (table.Length(var_id) != length) {
+          Error(name, "array ", name.lexeme, " has length ",
+                table.Length(var_id), " but ", target, " has length ", length);
+        }
+        return ASTNode(ASTNode::IDENTIFIER, var_id, &name);
+      }
+    }
+    return ParseExpr();
+  }
+
+  ASTNode ParseExpr() {
+    // stub expression handler for now, only works for literals and idents
+    if (auto token = IfToken(Lexer::ID_NUMBER)) {
+      return ASTNode(ASTNode::NUMBER, std::stod(token->lexeme));
+    }
+
+    if (auto token = IfToken(Lexer::ID_ID)) {
+      if (token_idx < tokens.size() &&
+          tokens[token_idx] == Lexer::ID_OPEN_PARENTHESIS) {
+        if (token->lexeme == "len") {
+          return ParseLen();
+        }
+        if (std::optional<builtins::Id> id = builtins::Find(token->lexeme)) {
+          ExpectToken(Lexer::ID_OPEN_PARENTHESIS);
+          ASTNode arg = ParseExpr();
+          ExpectToken(Lexer::ID_CLOSE_PARENTHESIS);
+          return MakeBuiltin(*token, *id, std::move(arg));
+        }
+        return ParseCall(*token);
+      }
+      if (AtLexeme(Lexer::ID_UNKNOWN, "[")) {
+        return ParseIndex(*token);
+      }
+      return ASTNode(ASTNode::IDENTIFIER,
+                     FindScalar(token->lexeme, token->line_id), token);
+    }
+
+    ErrorUnexpected(CurToken(), Lexer::ID_ID, Lexer::ID_NUMBER);
+  }
+
+  // name(args), with the name already consumed
+  ASTNode ParseCall(Token const &name) {
+    ASTNode node{ASTNode::CALL};
+    node.token = &name;
+    node.var_id = table.FindFunction(name.lexeme, name.line_id);
+    ExpectToken(Lexer::ID_OPEN_PARENTHESIS);
+    if (!IfToken(Lexer::ID_CLOSE_PARENTHESIS)) {
+      do {
+        node.AddChild(ParseExpr());
+      } while (IfToken(Lexer::ID_COMMA));
+      ExpectToken(Lexer::ID_CLOSE_PARENTHESIS);
+    }
+    size_t expected = table.GetFunction(node.var_id).num_params;
+    if (node.NumChildren() != expected) {
+      Error(name, "function ", name.lexeme, " takes ", expected,
+            " argument(s) but was given ", node.NumChildren());
+    }
+    return node;
+  }
+
+  // [pure] fn name(a, b) { ... return expr; }
+  ASTNode ParseFunction() {
+    bool pure = IfLexeme(Lexer::ID_ID, "pure");
+    Token const &fn_token = ExpectLexeme(Lexer::ID_ID, "fn");
+    if (table.ScopeDepth() != 1 || table.DefiningFunction()) {
+      Error(fn_token, "functions may only be declared at the top level");
+    }
+    Token const &name = ExpectToken(Lexer::ID_ID);
+    if (name.lexeme == "len" || builtins::Find(name.lexeme)) {
+      Error(name, name.lexeme, " is a built-in function");
+    }
+    size_t id = table.BeginFunction(name.lexeme, name.line_id, pure);
+    ExpectToken(Lexer::ID_OPEN_PARENTHESIS);
+    size_t num_params = 0;
+    if (!IfToken(Lexer::ID_CLOSE_PARENTHESIS)) {
+      do {
+        Token const &param = ExpectToken(Lexer::ID_ID);
+        table.AddVar(param.lexeme, param.line_id);
+        ++num_params;
+      } while (IfToken(Lexer::ID_COMMA));
+      ExpectToken(Lexer::ID_CLOSE_PARENTHESIS);
+    }
+    if (num_params > ASTNode::MAX_PARAMS) {
+      Error(name, "function ", name.lexeme, " has more than ",
+            ASTNode::MAX_PARAMS, " parameters");
+    }
+    // set before the body so recursive calls can be checked
+    table.GetFunction(id).num_params = num_params;
+    ASTNode body = ParseScope();
+    table.EndFunction();
+
+    // a return at the end means every call produces a value
+    if (body.NumChildren() == 0 ||
+        body.GetChild(body.NumChildren() - 1).type != ASTNode::RETURN) {
+      Error(name, "function ", name.lexeme, " must end with a return statement");
+    }
+    FunctionInfo &function = table.GetFunction(id);
+    function_bodies.push_back(std::move(body));
+    function.body = &function_bodies.back();
+    AnalyzeFunction(function, *function.body);
+    return ASTNode{};
+  }
+
+  // Records what a body can do outside its own frame. A pure function may
+  // only compute from its arguments (no prints, no globals, only pure
+  // calls), which is what makes memoizing it safe.
+  void AnalyzeFunction(FunctionInfo &function, ASTNode const &node) const {
+    std::string const &name = function.name;
+    size_t line = node.token ? node.token->line_id : function.line_declared;
+    switch (node.type) {
+    case ASTNode::PRINT:
+      if (function.pure) {
+        Error(line, "pure function ", name, " may not print");
+      }
+      function.prints = true;
+      break;
+    case ASTNode::ASSIGN:
+    case ASTNode::FOR:
+      if (size_t target = node.GetChild(0).var_id; !function.IsLocal(target)) {
+        if (function.pure) {
+          Error(line, "pure function ", name, " may not write global variable ",
+                table.GetName(target));
+        }
+        function.global_writes.push_back(target);
+      }
+      break;
+    case ASTNode::IDENTIFIER:
+    case ASTNode::INDEX:
+      if (function.pure && !function.IsLocal(node.var_id)) {
+        Error(line, "pure function ", name, " may not read global variable ",
+              table.GetName(node.var_id));
+      }
+      break;
+    case ASTNode::CALL:
+      if (FunctionInfo const &callee = table.GetFunction(node.var_id);
+          &callee != &function) {
+        if (function.pure && !callee.pure) {
+          Error(line, "pure function ", name, " may only call pure functions");
+        }
+        function.prints = function.prints || callee.prints;
+        function.global_writes.insert(function.global_writes.end(),
+                                      callee.global_writes.begin(),
+                                      callee.global_writes.end());
+      }
+      break;
+    default:
+      break;
+    }
+    for (size_t i = 0; i < node.NumChildren(); ++i) {
+      AnalyzeFunction(function, node.GetChild(i));
+    }
+  }
+
+  ASTNode ParseReturn() {
+    ASTNode node{ASTNode::RETURN};
+    node.token = &ExpectLexeme(Lexer::ID_ID, "return");
+    if (!table.DefiningFunction()) {
+      Error(*node.token, "return outside of a function");
+    }
+    node.AddChild(ParseExpr());
+    ExpectToken(Lexer::ID_ENDLINE);
+    return node;
+  }
+
+  ASTNode ParsePrint() {
+    ASTNode node{ASTNode::PRINT};
+    node.token = &ExpectToken(Lexer::ID_PRINT);
+    ExpectToken(Lexer::ID_OPEN_PARENTHESIS);
+    if (auto current = IfToken(Lexer::ID_STRING)) {
+      // strip quotes
+      std::string to_print =
+          current->lexeme.substr(1, current->lexeme.length() - 2);
+      std::vector<emplex2::Token> string_pieces{};
+      {
+        RunStats::Timer timer{run_stats, "string-lex"};
+        Tracer::Phase span{tracer, "string-lex"};
+        string_pieces = string_lexer.Tokenize(to_print);
+      }
+      for (auto token : string_pieces) {
+        switch (token.id) {
+        case emplex2::StringLexer::ID_LITERAL:
+          node.AddChild(ASTNode(ASTNode::STRING, token.lexeme));
+          break;
+        case emplex2::StringLexer::ID_ESCAPE_CHAR:
+          node.AddChild(ASTNode(ASTNode::STRING, token.lexeme));
+          break;
+        case emplex2::StringLexer::ID_IDENTIFIER: {
+          std::string ident = token.lexeme.substr(1, token.lexeme.length() - 2);
+          node.AddChild(ASTNode(ASTNode::IDENTIFIER,
+                                FindScalar(ident, current->line_id), nullptr));
+          break;
+        }
+        default:
+          // Since ID_LITERAL is a catchall for everything else, I don't think
+          // there should be any unexpected tokens in strings, but I'll think
+          // about it some more and maybe  add some better error handling.
+          assert(false);
+        }
+      }
+    } else {
+      node.AddChild(ParseExpr());
+    }
+    ExpectToken(Lexer::ID_CLOSE_PARENTHESIS);
+    ExpectToken(Lexer::ID_ENDLINE);
+    return node;
+  }
+
+  ASTNode ParseWhile() {
+    ASTNode node = ASTNode(ASTNode::WHILE);
+    node.token = &ExpectToken(Lexer::ID_WHILE);
+    ExpectToken(Lexer::ID_OPEN_PARENTHESIS);
+    // hack to get around dealing with expressions
+    // but still be able to do some basic testing
+    if (CurToken() == Lexer::ID_ID && !NextIs(Lexer::ID_OPEN_PARENTHESIS)) {
+      Token const &id = ConsumeToken();
+      node.AddChild(ASTNode(ASTNode::IDENTIFIER,
+                            FindScalar(id.lexeme, id.line_id), &id));
+    } else {
+      node.AddChild(ParseExpr());
+    }
+    ExpectToken(Lexer::ID_CLOSE_PARENTHESIS);
+    node.AddChild(ParseStatement());
+    return node;
+  }
+
+  // for (i = start; i < end) S
+  // parallel for (i = start; i < end) reduce(+: sum, max: hi) S
+  ASTNode ParseFor() {
+    bool parallel = IfLexeme(Lexer::ID_ID, "parallel");
+    Token const &for_token = ExpectLexeme(Lexer::ID_ID, "for");
+    ExpectToken(Lexer::ID_OPEN_PARENTHESIS);
+
+    ASTNode node{ASTNode::FOR};
+    node.token = &for_token;
+    if (parallel) {
+      node.literal = "parallel";
+    }
+
+    Token const &ident = ExpectToken(Lexer::ID_ID);
+    size_t var_id = FindScalar(ident.lexeme, ident.line_id);
+    ExpectToken(Lexer::ID_ASSIGN);
+    ASTNode start = ParseExpr();
+    ExpectToken(Lexer::ID_ENDLINE);
+    Token const &bound_ident = ExpectToken(Lexer::ID_ID);
+    if (table.FindVar(bound_ident.lexeme, bound_ident.line_id) != var_id) {
+      Error(bound_ident, "for-loop bound must test loop variable ",
+            ident.lexeme);
+    }
+    ExpectLexeme(Lexer::ID_COMPARE, "<");
+    ASTNode end = ParseExpr();
+    ExpectToken(Lexer::ID_CLOSE_PARENTHESIS);
+    std::optional<LoopRange> constant_range{};
+    if (start.type == ASTNode::NUMBER && end.type == ASTNode::NUMBER) {
+      constant_range = LoopRange{var_id, start.value, end.value};
+    }
+    node.AddChildren(ASTNode(ASTNode::IDENTIFIER, var_id, &ident),
+                     std::move(start), std::move(end));
+
+    // reductions are IDENTIFIER children holding their operator in literal
+    std::vector<size_t> reduce_ids{};
+    if (IfLexeme(Lexer::ID_ID, "reduce")) {
+      if (!parallel) {
+        Error(for_token, "reduce clause requires a parallel for");
+      }
+      ExpectToken(Lexer::ID_OPEN_PARENTHESIS);
+      do {
+        Token const &op = ConsumeToken();
+        if (op.lexeme != "+" && op.lexeme != "*" && op.lexeme != "min" &&
+            op.lexeme != "max") {
+          Error(op, "Unknown reduction operator '", op.lexeme, "'");
+        }
+        ExpectLexeme(Lexer::ID_UNKNOWN, ":");
+        Token const &red_ident = ExpectToken(Lexer::ID_ID);
+        ASTNode reduction{ASTNode::IDENTIFIER,
+                          FindScalar(red_ident.lexeme, red_ident.line_id),
+                          &red_ident};
+        reduction.literal = op.lexeme;
+        reduce_ids.push_back(reduction.var_id);
+        node.AddChild(std::move(reduction));
+      } while (IfToken(Lexer::ID_COMMA));
+      ExpectToken(Lexer::ID_CLOSE_PARENTHESIS);
+    }
+
+    // anything declared inside the body is private to each iteration
+    size_t first_local_id = table.NumVars();
+    if (constant_range) {
+      loop_ranges.push_back(*constant_range);
+    }
+    ASTNode body = ParseStatement();
+    if (constant_range) {
+      loop_ranges.pop_back();
+    }
+    ValidateForBody(body, var_id, parallel, reduce_ids, first_local_id);
+    // keep the body as the last child even when it's empty (ex. `var x;`)
+    node.AddChild(body ? std::move(body) : ASTNode{ASTNode::SCOPE});
+    return node;
+  }
+
+  // The loop variable belongs to the loop, and a parallel body may only write
+  // its own locals and its reduction variables, so iterations are independent.
+  void ValidateForBody(ASTNode const &node, size_t loop_var, bool parallel,
+                       std::vector<size_t> const &reduce_ids,
+                       size_t first_local_id) const {
+    if (node.type == ASTNode::ASSIGN || node.type == ASTNode::FOR) {
+      ASTNode const &target = node.GetChild(0);
+      size_t line = target.token->line_id;
+      if (target.var_id == loop_var) {
+        Error(line, "for-loop body may not assign loop variable ",
+              table.GetName(loop_var));
+      }
+      bool is_reduction = std::find(reduce_ids.begin(), reduce_ids.end(),
+                                    target.var_id) != reduce_ids.end();
+      if (parallel && target.var_id < first_local_id && !is_reduction) {
+        Error(line, "parallel for body may not write shared variable ",
+              table.GetName(target.var_id));
+      }
+    }
+    if (parallel && node.type == ASTNode::PRINT) {
+      // output order would depend on thread scheduling
+      Error(*node.token, "parallel for body may not print");
+    }
+    if (parallel && node.type == ASTNode::RETURN) {
+      Error(*node.token, "parallel for body may not return");
+    }
+    if (node.type == ASTNode::CALL) {
+      FunctionInfo const &callee = table.GetFunction(node.var_id);
+      // each thread calls into its own worker table, so anything but a
+      // pure function would lose its effects
+      if (parallel && !callee.pure) {
+        Error(*node.token, "parallel for body may only call pure functions");
+      }
+      if (std::find(callee.global_writes.begin(), callee.global_writes.end(),
+                    loop_var) != callee.global_writes.end()) {
+        Error(*node.token, "for-loop body may not assign loop variable ",
+              table.GetName(loop_var), " (through ", callee.name, ")");
+      }
+    }
+    for (size_t i = 0; i < node.NumChildren(); ++i) {
+      ValidateForBody(node.GetChild(i), loop_var, parallel, reduce_ids,
+                      first_local_id);
+    }
+  }
+
+  ASTNode ParseStatement() {
+    Token const &current = CurToken();
+    if (IsLexeme(Lexer::ID_ID, "for") && NextIsLexeme(Lexer::ID_OPEN_PARENTHESIS, "(")) {
+      return ParseFor();
+    }
+    if (IsLexeme(Lexer::ID_ID, "parallel") && NextIsLexeme(Lexer::ID_ID, "for")) {
+      return ParseFor();
+    }
+    if ((IsLexeme(Lexer::ID_ID, "fn") && NextIs(Lexer::ID_ID)) ||
+        (IsLexeme(Lexer::ID_ID, "pure") && NextIsLexeme(Lexer::ID_ID, "fn"))) {
+      return ParseFunction();
+    }
+    if (IsLexeme(Lexer::ID_ID, "return") && !NextIs(Lexer::ID_ASSIGN)) {
+      return ParseReturn();
+    }
+    if (current == Lexer::ID_ID && NextIs(Lexer::ID_OPEN_PARENTHESIS)) {
+      // a call for its effects; the result is dropped
+      ASTNode call = ParseCall(ConsumeToken());
+      ExpectToken(Lexer::ID_ENDLINE);
+      return call;
+    }
+    switch (current) {
+    case Lexer::ID_SCOPE_Start:
+      return ParseScope();
+    case Lexer::ID_VAR:
+      return ParseDecl();
+    case Lexer::ID_ID:
+      return ParseAssign();
+    case Lexer::ID_PRINT:
+      return ParsePrint();
+    case Lexer::ID_WHILE:
+      return ParseWhile();
+    default:
+      ErrorUnexpected(current);
+    }
+  }
+
+  // Pending input forms whole statements once every bracket is closed and
+  // the last token ends a statement; until then keep asking for more lines.
+  bool StatementsComplete() const {
+    int depth = 0;
+    for (size_t i = token_idx; i < tokens.size(); ++i) {
+      if (tokens[i] == Lexer::ID_SCOPE_Start ||
+          tokens[i] == Lexer::ID_OPEN_PARENTHESIS) {
+        ++depth;
+      } else if (tokens[i] == Lexer::ID_SCOPE_END ||
+                 tokens[i] == Lexer::ID_CLOSE_PARENTHESIS) {
+        --depth;
+      }
+    }
+    return depth <= 0 && token_idx < tokens.size() &&
+           (tokens.back() == Lexer::ID_ENDLINE ||
+            tokens.back() == Lexer::ID_SCOPE_END);
+  }
+
+public:
+  MacroCalc() = default;
+
+  MacroCalc(std::string_view source) : source_bytes(source.size()) {
+    {
+      RunStats::Timer timer{run_stats, "lex"};
+      Tracer::Phase span{tracer, "lex"};
+      tokens = lexer.Tokenize(source);
+    }
+    RunStats::Timer timer{run_stats, "parse"};
+    Tracer::Phase span{tracer, "parse"};
+    Parse();
+  };
+
+  void Parse() {
+    while (token_idx < tokens.size()) {
+      root.AddChild(ParseStatement());
+    }
+  }
+
+  void Execute() {
+    RunStats::Timer timer{run_stats, "execute"};
+    Tracer::Phase span{tracer, "execute"};
+    root.Run(table);
+    live_counter.Publish();
+  }
+
+  CostEstimate EstimateCost() const {
+    return CostEstimator::Estimate(root, table, source_bytes);
+  }
+
+  void FillStats(RunStats &stats) const {
+    stats.tokens = tokens.size();
+    stats.nodes = root.CountNodes();
+    stats.variables = table.NumVars();
+  }
+
+  void Restore(Checkpointer &checkpoints, std::string const &path) {
+    checkpoints.Restore(path, table);
+  }
+
+  // REPL entry point: lex just the new line, then parse and run each
+  // statement it completes against the same symbol table. Tokens are dropped
+  // once their statements have run, so earlier input is never revisited.
+  // Returns false if more input is needed to finish the current statement.
+  bool Feed(std::string line, size_t line_num) {
+    line += '\n';
+    for (Token token : lexer.Tokenize(line)) {
+      token.line_id = line_num;
+      tokens.push_back(token);
+    }
+    if (token_idx == tokens.size()) {
+      return true;
+    }
+    if (!StatementsComplete()) {
+      return false;
+    }
+    size_t num_functions = function_bodies.size();
+    while (token_idx < tokens.size()) {
+      size_t depth = table.ScopeDepth();
+      try {
+        ASTNode statement = ParseStatement();
+        statement.Run(table);
+        live_counter.Publish();
+      } catch (ErrorException const &) {
+        live_counter.Publish();
+        table.RestoreScopeDepth(depth);
+        loop_ranges.clear();
+        break;
+      }
+    }
+    if (function_bodies.size() != num_functions) {
+      // new function bodies point into these tokens
+      kept_tokens.push_back(std::move(tokens));
+    }
+    tokens.clear();
+    token_idx = 0;
+    return true;
+  }
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware performance counters through perf_event_open, for the benchmark
+// harness and --stats=counters. Each event is opened on its own rather than
+// as a group, so a machine (or VM, or container) missing some of them still
+// reports the rest; events that couldn't be opened are simply unavailable.
+// Counting is user-space only and follows threads created later, so
+// parallel for workers are included.
+class PerfCounters {
+public:
+  enum Event {
+    CYCLES = 0,
+    INSTRUCTIONS,
+    BRANCH_MISSES,
+    L1D_MISSES,
+    LLC_MISSES,
+    PAGE_FAULTS,
+    NUM_EVENTS
+  };
+
+  struct Counts {
+    std::array<double, NUM_EVENTS> values{};
+
+    double operator[](Event event) const { return values[event]; }
+
+    Counts &operator+=(Counts const &other) {
+      for (size_t i = 0; i < NUM_EVENTS; ++i) {
+        values[i] += other.values[i];
+      }
+      return *this;
+    }
+
+    Counts operator-(Counts const &other) const {
+      Counts out = *this;
+      for (size_t i = 0; i < NUM_EVENTS; ++i) {
+        out.values[i] -= other.values[i];
+      }
+      return out;
+    }
+
+    Counts operator/(double divisor) const {
+      Counts out = *this;
+      for (double &value : out.values) {
+        value /= divisor;
+      }
+      return out;
+    }
+
+    double IPC() const {
+      return values[CYCLES] > 0 ? values[INSTRUCTIONS] / values[CYCLES] : 0.0;
+    }
+  };
+
+private:
+  std::array<int, NUM_EVENTS> fds{};
+
+  static int Open(uint32_t type, uint64_t config) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return static_cast<int>(
+        syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0UL));
+  }
+
+  static constexpr uint64_t CacheMisses(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  }
+
+public:
+  PerfCounters() {
+    fds[CYCLES] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    fds[INSTRUCTIONS] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    fds[BRANCH_MISSES] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    fds[L1D_MISSES] =
+        Open(PERF_TYPE_HW_CACHE, CacheMisses(PERF_COUNT_HW_CACHE_L1D));
+    fds[LLC_MISSES] =
+        Open(PERF_TYPE_HW_CACHE, CacheMisses(PERF_COUNT_HW_CACHE_LL));
+    fds[PAGE_FAULTS] = Open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+  }
+
+  ~PerfCounters() {
+    for (int fd : fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  PerfCounters(PerfCounters const &) = delete;
+  PerfCounters &operator=(PerfCounters const &) = delete;
+
+  bool Available(Event event) const { return fds[event] >= 0; }
+
+  bool AnyAvailable() const {
+    for (int fd : fds) {
+      if (fd >= 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static char const *Name(Event event) {
+    static constexpr char const *NAMES[NUM_EVENTS] = {
+        "cycles",     "instructions", "branch-misses",
+        "L1D-misses", "LLC-misses",   "page-faults"};
+    return NAMES[event];
+  }
+
+  // Current totals. If the kernel had to multiplex an event, its count is
+  // scaled up by the share of time it was actually counting.
+  Counts Read() const {
+    Counts counts{};
+    for (size_t i = 0; i < NUM_EVENTS; ++i) {
+      uint64_t data[3]{}; // value, time enabled, time running
+      if (fds[i] < 0 || read(fds[i], data, sizeof(data)) != sizeof(data) ||
+          data[2] == 0) {
+        continue;
+      }
+      counts.values[i] = static_cast<double>(data[0]);
+      if (data[2] < data[1]) {
+        counts.values[i] *=
+            static_cast<double>(data[1]) / static_cast<double>(data[2]);
+      }
+    }
+    return counts;
+  }
+};
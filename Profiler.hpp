@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "lexer.hpp"
+
+// Line-level profiler for --profile. Every statement is timed as it runs;
+// its time counts as inclusive for the line it starts on and, minus the time
+// of the statements nested inside it, as exclusive. Loops are also
+// totalled per node so a hot line can be tied back to the loop driving it.
+//
+// Parallel for workers each profile into their own Profiler, merged in after
+// the join. Their lines add up the time of every worker, so they can come to
+// more than the loop's own inclusive time; the loop line's exclusive time is
+// what's left of its wall time, or zero.
+class Profiler {
+public:
+  using clock = std::chrono::steady_clock;
+
+private:
+  struct LineStats {
+    uint64_t count = 0;
+    clock::duration inclusive{};
+    clock::duration exclusive{};
+    size_t active = 0; // nested statements on one line only count once
+  };
+
+  struct BlockStats {
+    std::string kind{};
+    size_t line = 0;
+    uint64_t entries = 0;
+    uint64_t iterations = 0;
+    clock::duration inclusive{};
+  };
+
+  struct Frame {
+    size_t line;
+    clock::time_point start;
+    clock::duration nested{};
+  };
+
+  std::string_view source;
+  std::vector<LineStats> lines{};
+  std::map<emplex::Token const *, BlockStats> blocks{};
+  std::vector<Frame> stack{};
+  clock::duration outermost{}; // total time of statements run at depth 0
+
+  // lines taking at least this share of exclusive time get flagged
+  static constexpr double HOT_SHARE = 0.10;
+
+  static double Millis(clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+  }
+
+public:
+  Profiler(std::string_view source = {}) : source(source) {}
+
+  void Enter(size_t line) {
+    if (line >= lines.size()) {
+      lines.resize(line + 1);
+    }
+    ++lines[line].count;
+    ++lines[line].active;
+    stack.push_back({line, clock::now()});
+  }
+
+  void Exit() {
+    Frame frame = stack.back();
+    stack.pop_back();
+    clock::duration elapsed = clock::now() - frame.start;
+    LineStats &stats = lines[frame.line];
+    stats.exclusive += std::max(elapsed - frame.nested, clock::duration{});
+    if (--stats.active == 0) {
+      stats.inclusive += elapsed;
+    }
+    if (!stack.empty()) {
+      stack.back().nested += elapsed;
+    } else {
+      outermost += elapsed;
+    }
+  }
+
+  // Adds in a parallel for worker's profile; its statements count as nested
+  // in the statement running here (the loop).
+  void Merge(Profiler const &worker) {
+    if (worker.lines.size() > lines.size()) {
+      lines.resize(worker.lines.size());
+    }
+    for (size_t line = 0; line < worker.lines.size(); ++line) {
+      lines[line].count += worker.lines[line].count;
+      lines[line].inclusive += worker.lines[line].inclusive;
+      lines[line].exclusive += worker.lines[line].exclusive;
+    }
+    for (auto const &[token, worker_stats] : worker.blocks) {
+      BlockStats &stats = blocks[token];
+      stats.kind = worker_stats.kind;
+      stats.line = worker_stats.line;
+      stats.entries += worker_stats.entries;
+      stats.iterations += worker_stats.iterations;
+      stats.inclusive += worker_stats.inclusive;
+    }
+    if (!stack.empty()) {
+      stack.back().nested += worker.outermost;
+    }
+  }
+
+  void AddBlock(emplex::Token const *token, std::string const &kind,
+                uint64_t iterations, clock::duration elapsed) {
+    BlockStats &stats = blocks[token];
+    stats.kind = kind;
+    stats.line = token->line_id;
+    ++stats.entries;
+    stats.iterations += iterations;
+    stats.inclusive += elapsed;
+  }
+
+  // Times one statement; does nothing if profiling is off.
+  class Timer {
+  private:
+    Profiler *profiler;
+
+  public:
+    Timer(Profiler *profiler, emplex::Token const *token)
+        : profiler(token ? profiler : nullptr) {
+      if (this->profiler) {
+        this->profiler->Enter(token->line_id);
+      }
+    }
+    ~Timer() {
+      if (profiler) {
+        profiler->Exit();
+      }
+    }
+    Timer(Timer const &) = delete;
+    Timer &operator=(Timer const &) = delete;
+  };
+
+  void Report(std::ostream &out) const {
+    clock::duration total{};
+    for (LineStats const &stats : lines) {
+      total += stats.exclusive;
+    }
+
+    out << "Profile (times in ms, '>>' marks lines with at least "
+        << HOT_SHARE * 100 << "% of exclusive time)\n";
+    out << "     line        count    inclusive    exclusive  excl%  source\n";
+    std::istringstream listing{std::string{source}};
+    std::string text;
+    for (size_t line = 1; std::getline(listing, text); ++line) {
+      LineStats stats = line < lines.size() ? lines[line] : LineStats{};
+      double share = total.count() ? static_cast<double>(stats.exclusive.count()) /
+                                         static_cast<double>(total.count())
+                                   : 0.0;
+      out << (share >= HOT_SHARE ? ">> " : "   ") << std::setw(6) << line;
+      if (stats.count) {
+        out << std::fixed << std::setprecision(3) << std::setw(13)
+            << stats.count << std::setw(13) << Millis(stats.inclusive)
+            << std::setw(13) << Millis(stats.exclusive) << std::setw(6)
+            << std::setprecision(1) << share * 100 << "%";
+      } else {
+        out << std::string(46, ' ');
+      }
+      out << "  " << text << '\n';
+    }
+
+    if (!blocks.empty()) {
+      out << "\n   block                 entries   iterations    inclusive\n";
+      for (auto const &[token, stats] : blocks) {
+        std::string name = stats.kind + "@L" + std::to_string(stats.line);
+        out << "   " << std::left << std::setw(18) << name << std::right
+            << std::setw(11) << stats.entries << std::setw(13)
+            << stats.iterations << std::setw(13) << std::fixed
+            << std::setprecision(3) << Millis(stats.inclusive) << '\n';
+      }
+    }
+    out << std::defaultfloat << std::flush;
+  }
+};
+
+// Parallel for workers get their own, merged in after the join.
+inline thread_local Profiler *profiler = nullptr;
@@ -1,217 +1,520 @@
-#include <cassert>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <deque>
 #include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <string>
-
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
-#include "ASTNode.hpp"
+#include "Checkpoint.hpp"
+#include "CostCounter.hpp"
+#include "CostEstimate.hpp"
+#include "DispatchHistogram.hpp"
 #include "Error.hpp"
-#include "SymbolTable.hpp"
-#include "lexer.hpp"
-#include "string_lexer.hpp"
+#include "FlameGraph.hpp"
+#include "LatencyHistogram.hpp"
+#include "LiveStats.hpp"
+#include "LoopGuard.hpp"
+#include "MacroCalc.hpp"
+#include "Profiler.hpp"
+#include "RunStats.hpp"
+#include "Sampler.hpp"
+#include "Trace.hpp"
 
-using namespace emplex;
+void RunRepl() {
+  throw_on_error = true;
+  bool interactive = isatty(STDIN_FILENO);
+  MacroCalc calc{};
+  std::string line;
+  size_t line_num = 0;
+  bool complete = true;
+  while (true) {
+    if (interactive) {
+      std::cout << (complete ? "> " : "... ") << std::flush;
+    }
+    if (!std::getline(std::cin, line)) {
+      break;
+    }
+    complete = calc.Feed(line, ++line_num);
+  }
+  if (!complete) {
+    ErrorNoLine("Unexpected EOF");
+  }
+}
 
-class MacroCalc {
-private:
-  std::vector<Token> tokens{};
-  emplex::Lexer lexer{};
-  SymbolTable table{};
-  size_t token_idx{0};
-  ASTNode root{ASTNode::SCOPE};
+volatile std::sig_atomic_t latency_report_requested = 0;
 
-  emplex2::StringLexer string_lexer{};
+struct BatchLatency {
+  LatencyHistogram parse{};
+  LatencyHistogram execute{};
+  LatencyHistogram total{};
+  // total latency by estimated cost class
+  std::array<LatencyHistogram, CostEstimate::NUM_CLASSES> by_class{};
+  // a script that fails at run time still counts in execute and total
+  size_t parse_failed = 0; // including files that couldn't be read
+  size_t run_failed = 0;
 
-  Token const &CurToken() const {
-    if (token_idx >= tokens.size())
-      ErrorNoLine("Unexpected EOF");
-    return tokens.at(token_idx);
+  void Report() const {
+    LatencyHistogram::ReportHeader(std::cerr);
+    parse.ReportRow(std::cerr, "parse");
+    execute.ReportRow(std::cerr, "execute");
+    total.ReportRow(std::cerr, "total");
+    for (size_t i = 0; i < by_class.size(); ++i) {
+      if (by_class[i].Count()) {
+        by_class[i].ReportRow(
+            std::cerr, CostEstimate::ClassName(static_cast<CostEstimate::Class>(i)));
+      }
+    }
+    std::cerr << parse_failed << " of " << total.Count()
+              << " scripts failed to parse, " << run_failed
+              << " failed while running" << std::endl;
   }
 
-  Token const &ConsumeToken() {
-    if (token_idx >= tokens.size())
-      ErrorNoLine("Unexpected EOF");
-    return tokens.at(token_idx++);
+  size_t Failed() const { return parse_failed + run_failed; }
+};
+
+uint64_t NanosSince(std::chrono::steady_clock::time_point start) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count());
+}
+
+// a parsed script waiting to run
+struct BatchJob {
+  std::unique_ptr<MacroCalc> calc{};
+  std::chrono::steady_clock::time_point start{};
+  uint64_t parse_nanos = 0;
+  CostEstimate::Class cost_class = CostEstimate::FAST;
+};
+
+// Runs a parsed script and records its latency under `mutex`. With
+// `buffered`, its output and errors are held back and written out whole
+// once it's done, so scripts running at the same time don't interleave.
+void ExecuteJob(BatchJob &job, BatchLatency &latency, std::mutex &mutex,
+                bool buffered) {
+  std::ostringstream output{};
+  std::ostringstream errors{};
+  if (buffered) {
+    script_output = &output;
+    error_output = &errors;
+  }
+  auto executed = std::chrono::steady_clock::now();
+  bool failed = false;
+  try {
+    job.calc->Execute();
+  } catch (ErrorException const &) {
+    failed = true;
   }
+  uint64_t execute_nanos = NanosSince(executed);
+  script_output = &std::cout;
+  error_output = &std::cerr;
 
-  Token const &ExpectToken(int token) {
-    if (CurToken() == token) {
-      return ConsumeToken();
-    }
-    ErrorUnexpected(CurToken(), token);
+  std::lock_guard lock{mutex};
+  if (buffered) {
+    std::cout << output.str() << std::flush;
+    std::cerr << errors.str() << std::flush;
+  }
+  uint64_t total_nanos = NanosSince(job.start);
+  if (failed) {
+    ++latency.run_failed;
   }
+  latency.execute.Record(execute_nanos);
+  latency.parse.Record(job.parse_nanos);
+  latency.total.Record(total_nanos);
+  latency.by_class[job.cost_class].Record(total_nanos);
+}
 
-  // rose: C++ optionals can't hold references, grumble grumble
-  Token const *IfToken(int token) {
-    if (CurToken() == token) {
-      return &ConsumeToken();
-    }
-    return nullptr;
+// Runs many scripts in one process, each with a fresh interpreter; a script
+// that fails reports its error and the batch moves on. Scripts come from the
+// command line, or one path per line on stdin if there are none. With
+// `latency`, per-script parse and execute times go into histograms that are
+// reported at exit, and also after the next script finishes whenever the
+// process gets SIGUSR1.
+//
+// With `heavy_workers`, each script is classified by its static cost
+// estimate once it's parsed: heavy ones queue for that many worker threads
+// while the rest run straight away, so a long script doesn't hold up the
+// short ones behind it. Each script's output then comes out in one piece
+// when it finishes, in finishing order rather than input order.
+int RunBatch(std::vector<std::string> paths, bool latency,
+             size_t heavy_workers) {
+  throw_on_error = true;
+  if (latency) {
+    std::signal(SIGUSR1, [](int) { latency_report_requested = 1; });
   }
+  BatchLatency stats{};
+  bool routed = heavy_workers > 0;
+  // guards stats and whole-script writes to std::cout and std::cerr
+  std::mutex mutex{};
 
-  ASTNode ParseScope() {
-    ExpectToken(Lexer::ID_SCOPE_Start);
-    ASTNode scope{ASTNode::SCOPE};
-    table.PushScope();
-    while (CurToken() != Lexer::ID_SCOPE_END) {
-      scope.AddChild(ParseStatement());
-    }
-    ConsumeToken();
-    table.PopScope();
-    return scope;
+  std::deque<BatchJob> heavy_queue{};
+  std::condition_variable queued{};
+  bool done = false;
+  std::vector<std::thread> workers{};
+  for (size_t i = 0; i < heavy_workers; ++i) {
+    workers.emplace_back([&]() {
+      throw_on_error = true;
+      while (true) {
+        BatchJob job{};
+        {
+          std::unique_lock lock{mutex};
+          queued.wait(lock, [&]() { return done || !heavy_queue.empty(); });
+          if (heavy_queue.empty()) {
+            return;
+          }
+          job = std::move(heavy_queue.front());
+          heavy_queue.pop_front();
+        }
+        ExecuteJob(job, stats, mutex, true);
+      }
+    });
   }
 
-  ASTNode ParseDecl() {
-    ExpectToken(Lexer::ID_VAR);
-    Token const &ident = ExpectToken(Lexer::ID_ID);
-    if (IfToken(Lexer::ID_ENDLINE)) {
-      table.AddVar(ident.lexeme, ident.line_id);
-      return ASTNode{};
+  bool from_stdin = paths.empty();
+  std::string path;
+  for (size_t next = 0;; ++next) {
+    if (from_stdin ? !std::getline(std::cin, path) : next == paths.size()) {
+      break;
     }
-    ExpectToken(Lexer::ID_ASSIGN);
-
-    ASTNode expr = ParseExpr();
-    ExpectToken(Lexer::ID_ENDLINE);
+    if (!from_stdin) {
+      path = paths[next];
+    } else if (path.empty()) {
+      continue;
+    }
+    std::ifstream in_file(path);
+    if (in_file.fail()) {
+      std::lock_guard lock{mutex};
+      std::cerr << "ERROR: Unable to open file '" << path << "'." << std::endl;
+      ++stats.parse_failed;
+      continue;
+    }
+    std::string source{std::istreambuf_iterator<char>(in_file),
+                       std::istreambuf_iterator<char>{}};
 
-    // don't add until _after_ we possibly resolve idents in expression
-    // ex. var foo = foo should error if foo is undefined
-    size_t var_id = table.AddVar(ident.lexeme, ident.line_id);
+    BatchJob job{};
+    job.start = std::chrono::steady_clock::now();
+    std::ostringstream errors{};
+    if (routed) {
+      error_output = &errors;
+    }
+    try {
+      job.calc = std::make_unique<MacroCalc>(source);
+    } catch (ErrorException const &) {
+    }
+    error_output = &std::cerr;
+    job.parse_nanos = NanosSince(job.start);
 
-    ASTNode out = ASTNode{ASTNode::ASSIGN};
-    out.AddChildren(ASTNode(ASTNode::IDENTIFIER, var_id, &ident), expr);
+    if (!job.calc) {
+      // a script that fails to parse still took its parse time
+      std::lock_guard lock{mutex};
+      std::cerr << errors.str() << std::flush;
+      ++stats.parse_failed;
+      stats.parse.Record(job.parse_nanos);
+      stats.total.Record(NanosSince(job.start));
+    } else {
+      job.cost_class = job.calc->EstimateCost().Classify();
+      if (routed && job.cost_class == CostEstimate::HEAVY) {
+        std::lock_guard lock{mutex};
+        heavy_queue.push_back(std::move(job));
+        queued.notify_one();
+      } else {
+        ExecuteJob(job, stats, mutex, routed);
+      }
+    }
 
-    return out;
+    if (latency_report_requested) {
+      latency_report_requested = 0;
+      std::lock_guard lock{mutex};
+      stats.Report();
+    }
   }
 
-  ASTNode ParseAssign() {
-    Token new_id = ExpectToken(Lexer::ID_ID);
-    ExpectToken(Lexer::ID_ASSIGN);
-    ASTNode node = ASTNode{ASTNode::ASSIGN};
-    size_t var_id = table.FindVar(new_id.lexeme, new_id.line_id);
-    node.AddChildren(ASTNode(ASTNode::IDENTIFIER, var_id, &new_id),
-                     ParseExpr());
-    ExpectToken(Lexer::ID_ENDLINE);
-    return node;
+  {
+    std::lock_guard lock{mutex};
+    done = true;
   }
+  queued.notify_all();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  std::cout << std::flush;
+  if (latency) {
+    stats.Report();
+  }
+  return stats.Failed() ? 1 : 0;
+}
 
-  ASTNode ParseExpr() {
-    // stub expression handler for now, only works for literals and idents
-    if (auto token = IfToken(Lexer::ID_NUMBER)) {
-      return ASTNode(ASTNode::NUMBER, std::stod(token->lexeme));
-    }
-
-    if (auto token = IfToken(Lexer::ID_ID)) {
-      return ASTNode(ASTNode::IDENTIFIER,
-                     table.FindVar(token->lexeme, token->line_id), token);
-    }
+// value of a `--name=value` argument, or nullopt if arg isn't that option
+std::optional<std::string> OptionValue(std::string const &arg,
+                                       std::string const &name) {
+  std::string prefix = name + "=";
+  if (arg.starts_with(prefix)) {
+    return arg.substr(prefix.size());
+  }
+  return std::nullopt;
+}
 
-    ErrorUnexpected(CurToken(), Lexer::ID_ID, Lexer::ID_NUMBER);
-  }
-
-  ASTNode ParsePrint() {
-    ExpectToken(Lexer::ID_PRINT);
-    ExpectToken(Lexer::ID_OPEN_PARENTHESIS);
-    ASTNode node{ASTNode::PRINT};
-    if (auto current = IfToken(Lexer::ID_STRING)) {
-      // strip quotes
-      std::string to_print =
-          current->lexeme.substr(1, current->lexeme.length() - 2);
-      std::vector<emplex2::Token> string_pieces =
-          string_lexer.Tokenize(to_print);
-      for (auto token : string_pieces) {
-        switch (token.id) {
-        case emplex2::StringLexer::ID_LITERAL:
-          node.AddChild(ASTNode(ASTNode::STRING, token.lexeme));
-          break;
-        case emplex2::StringLexer::ID_ESCAPE_CHAR:
-          node.AddChild(ASTNode(ASTNode::STRING, token.lexeme));
-          break;
-        case emplex2::StringLexer::ID_IDENTIFIER: {
-          std::string ident = token.lexeme.substr(1, token.lexeme.length() - 2);
-          node.AddChild(ASTNode(ASTNode::IDENTIFIER,
-                                table.FindVar(ident, current->line_id),
-                                nullptr));
-          break;
-        }
-        default:
-          // Since ID_LITERAL is a catchall for everything else, I don't think
-          // there should be any unexpected tokens in strings, but I'll think
-          // about it some more and maybe  add some better error handling.
-          assert(false);
-        }
+int main(int argc, char *argv[]) {
+  std::string const usage = std::string{"Format: "} + argv[0] +
+                            " [--repl] [--checkpoint-every=N]"
+                            " [--restore=checkpoint] [--live-stats]"
+                            " [--detect-infinite-loops[=K]] [--profile]"
+                            " [--flamegraph=out.folded] [--sample[=HZ]]"
+                            " [--stats[=counters]] [--cost] [--trace=out.json]"
+                            " [--trace-threshold-ms=MS]"
+                            " [--dispatch-histogram=hist.tsv] [--estimate]"
+                            " [--threads=N] [filename]\n"
+                            "   or: " + argv[0] +
+                            " --batch [--latency] [--heavy-workers=N]"
+                            " [filename...]";
+  std::string filename{};
+  bool repl = false;
+  bool batch = false;
+  bool report_latency = false;
+  // threads that run only the scripts estimated heavy; 0 runs everything in
+  // order on the main thread
+  size_t heavy_workers = 0;
+  bool report_estimate = false;
+  std::vector<std::string> batch_paths{};
+  bool publish_live_stats = false;
+  bool profile = false;
+  std::string flamegraph_path{};
+  std::string trace_path{};
+  // merged into if it already exists, to build one histogram for a corpus
+  std::string histogram_path{};
+  // loops at least this long get their own trace span
+  double trace_threshold_ms = 1.0;
+  unsigned sample_hertz = 0;
+  bool report_stats = false;
+  bool report_counters = false;
+  bool report_cost = false;
+  // sample every Kth WHILE back-edge; 0 leaves detection off
+  uint64_t loop_check_every = 0;
+  uint64_t checkpoint_every = 0;
+  std::string restore_path{};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--repl") {
+      repl = true;
+    } else if (arg == "--batch") {
+      batch = true;
+    } else if (arg == "--latency") {
+      report_latency = true;
+    } else if (auto workers = OptionValue(arg, "--heavy-workers")) {
+      try {
+        heavy_workers = std::stoul(*workers);
+      } catch (std::exception const &) {
+        ErrorNoLine(usage);
       }
+    } else if (arg == "--estimate") {
+      report_estimate = true;
+    } else if (arg == "--live-stats") {
+      publish_live_stats = true;
+    } else if (arg == "--profile") {
+      profile = true;
+    } else if (auto path = OptionValue(arg, "--flamegraph")) {
+      flamegraph_path = *path;
+    } else if (auto path = OptionValue(arg, "--trace")) {
+      trace_path = *path;
+    } else if (auto path = OptionValue(arg, "--dispatch-histogram")) {
+      histogram_path = *path;
+    } else if (auto ms = OptionValue(arg, "--trace-threshold-ms")) {
+      try {
+        trace_threshold_ms = std::stod(*ms);
+      } catch (std::exception const &) {
+        ErrorNoLine(usage);
+      }
+    } else if (arg == "--stats") {
+      report_stats = true;
+    } else if (arg == "--stats=counters") {
+      report_stats = report_counters = true;
+    } else if (arg == "--cost") {
+      report_cost = true;
+    } else if (arg == "--sample") {
+      sample_hertz = 1000;
+    } else if (auto hertz = OptionValue(arg, "--sample")) {
+      try {
+        sample_hertz = static_cast<unsigned>(std::stoul(*hertz));
+      } catch (std::exception const &) {
+        ErrorNoLine(usage);
+      }
+      if (sample_hertz == 0) {
+        ErrorNoLine(usage);
+      }
+    } else if (arg == "--detect-infinite-loops") {
+      loop_check_every = 16;
+    } else if (auto every = OptionValue(arg, "--detect-infinite-loops")) {
+      try {
+        loop_check_every = std::stoull(*every);
+      } catch (std::exception const &) {
+        ErrorNoLine(usage);
+      }
+      if (loop_check_every == 0) {
+        ErrorNoLine(usage);
+      }
+    } else if (auto every = OptionValue(arg, "--checkpoint-every")) {
+      try {
+        checkpoint_every = std::stoull(*every);
+      } catch (std::exception const &) {
+        ErrorNoLine(usage);
+      }
+    } else if (auto path = OptionValue(arg, "--restore")) {
+      restore_path = *path;
+    } else if (auto threads = OptionValue(arg, "--threads")) {
+      try {
+        parallel_threads = std::stoul(*threads);
+      } catch (std::exception const &) {
+        ErrorNoLine(usage);
+      }
+      if (parallel_threads == 0) {
+        ErrorNoLine(usage);
+      }
+    } else if (arg.starts_with("--")) {
+      ErrorNoLine(usage);
     } else {
-      node.AddChild(ParseExpr());
-    }
-    ExpectToken(Lexer::ID_CLOSE_PARENTHESIS);
-    ExpectToken(Lexer::ID_ENDLINE);
-    return node;
-  }
-
-  ASTNode ParseWhile() {
-    ExpectToken(Lexer::ID_WHILE);
-    ExpectToken(Lexer::ID_OPEN_PARENTHESIS);
-    ASTNode node = ASTNode(ASTNode::WHILE);
-    // hack to get around dealing with expressions
-    // but still be able to do some basic testing
-    if (CurToken() == Lexer::ID_ID) {
-      Token id = ConsumeToken();
-      node.AddChild(ASTNode(ASTNode::IDENTIFIER,
-                            table.FindVar(id.lexeme, id.line_id), &id));
-    } else {
-      node.AddChild(ParseExpr());
+      batch_paths.push_back(arg);
+      filename = arg;
     }
-    ExpectToken(Lexer::ID_CLOSE_PARENTHESIS);
-    node.AddChild(ParseStatement());
-    return node;
-  }
-
-  ASTNode ParseStatement() {
-    Token const &current = CurToken();
-    switch (current) {
-    case Lexer::ID_SCOPE_Start:
-      return ParseScope();
-    case Lexer::ID_VAR:
-      return ParseDecl();
-    case Lexer::ID_ID:
-      return ParseAssign();
-    case Lexer::ID_PRINT:
-      return ParsePrint();
-    case Lexer::ID_WHILE:
-      return ParseWhile();
-    default:
-      ErrorUnexpected(current);
+  }
+
+  if (publish_live_stats) {
+    PublishLiveStats();
+    instrumented = true;
+  }
+  std::optional<LoopGuard> guard{};
+  if (loop_check_every) {
+    guard.emplace(loop_check_every);
+    loop_guard = &*guard;
+  }
+  if (repl) {
+    RunRepl();
+    return 0;
+  }
+  if (batch) {
+    // the per-script reports and checkpoints only work for a single script
+    if (profile || report_stats || report_cost || report_estimate ||
+        sample_hertz || !flamegraph_path.empty() || !trace_path.empty() ||
+        !histogram_path.empty() || checkpoint_every || !restore_path.empty()) {
+      ErrorNoLine(usage);
     }
+    return RunBatch(batch_paths, report_latency, heavy_workers);
+  }
+  if (batch_paths.size() != 1 || report_latency || heavy_workers) {
+    ErrorNoLine(usage);
   }
 
-public:
-  MacroCalc(std::ifstream &input) {
-    tokens = lexer.Tokenize(input);
-    Parse();
-  };
+  // reported at exit, so a script that stops on an error still reports the
+  // work done before it
+  static CostCounter costs{};
+  if (report_cost) {
+    cost_counter = &costs;
+    std::atexit([] { costs.Report(std::cerr); });
+  }
 
-  void Parse() {
-    while (token_idx < tokens.size()) {
-      root.AddChild(ParseStatement());
+  std::optional<RunStats> stats{};
+  if (report_stats) {
+    stats.emplace();
+    run_stats = &*stats;
+    if (report_counters && !stats->EnableCounters()) {
+      std::cerr << "Hardware counters unavailable; reporting times only."
+                << std::endl;
     }
   }
 
-  void Execute() { root.Run(table); }
-};
+  std::optional<Tracer> trace{};
+  if (!trace_path.empty()) {
+    trace.emplace(std::chrono::duration_cast<Tracer::clock::duration>(
+        std::chrono::duration<double, std::milli>(trace_threshold_ms)));
+    tracer = &*trace;
+  }
 
-int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    ErrorNoLine("Format: ", argv[0], " [filename]");
+  std::string source{};
+  {
+    RunStats::Timer timer{run_stats, "read"};
+    Tracer::Phase span{tracer, "read"};
+    std::ifstream in_file(filename);
+    if (in_file.fail()) {
+      ErrorNoLine("Unable to open file '", filename, "'.");
+    }
+    source.assign(std::istreambuf_iterator<char>(in_file),
+                  std::istreambuf_iterator<char>{});
   }
 
-  std::string filename = argv[1];
+  MacroCalc calc{source};
+  calc.Parse();
+  if (report_estimate) {
+    calc.EstimateCost().Report(std::cerr);
+  }
 
-  std::ifstream in_file(filename);
-  if (in_file.fail()) {
-    ErrorNoLine("Unable to open file '", filename, "'.");
+  // checkpoints land next to the script as <filename>.ckpt
+  std::optional<Checkpointer> checkpoints{};
+  if (checkpoint_every || !restore_path.empty()) {
+    checkpoints.emplace(filename + ".ckpt", checkpoint_every, source);
+    if (!restore_path.empty()) {
+      calc.Restore(*checkpoints, restore_path);
+      checkpoints->RestoreOutput();
+    }
+    checkpointer = &*checkpoints;
   }
 
-  MacroCalc calc{in_file};
-  calc.Parse();
+  // the report goes to stderr so it doesn't mix with the script's output
+  std::optional<Profiler> line_profiler{};
+  if (profile) {
+    line_profiler.emplace(source);
+    profiler = &*line_profiler;
+  }
+  std::optional<FlameGraph> flame_graph{};
+  if (!flamegraph_path.empty()) {
+    flame_graph.emplace();
+    flamegraph = &*flame_graph;
+  }
+  std::optional<DispatchHistogram> histogram{};
+  if (!histogram_path.empty()) {
+    histogram.emplace();
+    dispatch_histogram = &*histogram;
+  }
+  sampling = sample_hertz != 0;
+  instrumented = cost_counter || run_stats || profiler || flamegraph ||
+                 tracer || dispatch_histogram || live_stats || sampling;
+  std::optional<Sampler> sampler{};
+  if (sample_hertz) {
+    sampler.emplace(source);
+    sampler->Start(sample_hertz);
+  }
   calc.Execute();
+  if (sampler) {
+    sampler->Stop();
+    sampler->Report(std::cerr);
+  }
+  if (line_profiler) {
+    line_profiler->Report(std::cerr);
+  }
+  if (flame_graph) {
+    flame_graph->Write(flamegraph_path);
+  }
+  if (histogram) {
+    histogram->Write(histogram_path, ASTNode::TypeName);
+  }
+  if (stats || trace) {
+    RunStats::Timer timer{run_stats, "flush"};
+    Tracer::Phase span{tracer, "flush"};
+    std::cout << std::flush;
+  }
+  if (trace) {
+    trace->Write(trace_path);
+  }
+  if (stats) {
+    calc.FillStats(*stats);
+    stats->Report(std::cerr);
+  }
 }
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "PerfCounters.hpp"
+
+// Per-phase timing and throughput for --stats. Phases nest (string lexing
+// happens in the middle of parsing), so each phase reports only its own
+// time, with nested phases taken out. With counters enabled, hardware
+// events are charged to phases the same way.
+class RunStats {
+public:
+  struct Time {
+    double wall_ms = 0;
+    double cpu_ms = 0;
+    PerfCounters::Counts events{};
+
+    Time &operator+=(Time const &other) {
+      wall_ms += other.wall_ms;
+      cpu_ms += other.cpu_ms;
+      events += other.events;
+      return *this;
+    }
+
+    Time operator-(Time const &other) const {
+      return {wall_ms - other.wall_ms, cpu_ms - other.cpu_ms,
+              events - other.events};
+    }
+  };
+
+private:
+  struct Phase {
+    std::string name{};
+    Time self{};
+  };
+
+  struct Active {
+    size_t phase;
+    Time start;
+    Time nested{};
+  };
+
+  std::vector<Phase> phases{};
+  std::vector<Active> stack{};
+  std::unique_ptr<PerfCounters> counters{};
+
+  Time Now() const {
+    timespec cpu{};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    auto wall = std::chrono::steady_clock::now().time_since_epoch();
+    return {std::chrono::duration<double, std::milli>(wall).count(),
+            static_cast<double>(cpu.tv_sec) * 1e3 +
+                static_cast<double>(cpu.tv_nsec) / 1e6,
+            counters ? counters->Read() : PerfCounters::Counts{}};
+  }
+
+  void ReportCounters(std::ostream &out) const {
+    out << "phase       ";
+    for (size_t event = 0; event < PerfCounters::NUM_EVENTS; ++event) {
+      out << std::setw(15)
+          << PerfCounters::Name(static_cast<PerfCounters::Event>(event));
+    }
+    out << std::setw(8) << "IPC" << '\n';
+    for (Phase const &phase : phases) {
+      out << std::left << std::setw(12) << phase.name << std::right;
+      for (size_t event = 0; event < PerfCounters::NUM_EVENTS; ++event) {
+        if (counters->Available(static_cast<PerfCounters::Event>(event))) {
+          out << std::setw(15) << phase.self.events.values[event];
+        } else {
+          out << std::setw(15) << "n/a";
+        }
+      }
+      if (counters->Available(PerfCounters::CYCLES) &&
+          counters->Available(PerfCounters::INSTRUCTIONS)) {
+        out << std::setprecision(2) << std::setw(8) << phase.self.events.IPC()
+            << std::setprecision(0);
+      } else {
+        out << std::setw(8) << "n/a";
+      }
+      out << '\n';
+    }
+    out << '\n';
+  }
+
+public:
+  uint64_t statements = 0;
+  size_t tokens = 0;
+  size_t nodes = 0;
+  size_t variables = 0;
+
+  // Returns false (and leaves counters off) if no event could be opened,
+  // e.g. under a restrictive perf_event_paranoid or in a container.
+  bool EnableCounters() {
+    counters = std::make_unique<PerfCounters>();
+    if (!counters->AnyAvailable()) {
+      counters.reset();
+    }
+    return counters != nullptr;
+  }
+
+  // Adds in a parallel for worker's counts (workers only count statements)
+  void Merge(RunStats const &worker) { statements += worker.statements; }
+
+  void Begin(std::string const &name) {
+    size_t phase = 0;
+    while (phase < phases.size() && phases[phase].name != name) {
+      ++phase;
+    }
+    if (phase == phases.size()) {
+      phases.push_back({name});
+    }
+    stack.push_back({phase, Now()});
+  }
+
+  void End() {
+    Active active = stack.back();
+    stack.pop_back();
+    Time elapsed = Now() - active.start;
+    phases[active.phase].self += elapsed - active.nested;
+    if (!stack.empty()) {
+      stack.back().nested += elapsed;
+    }
+  }
+
+  Time Get(std::string const &name) const {
+    for (Phase const &phase : phases) {
+      if (phase.name == name) {
+        return phase.self;
+      }
+    }
+    return {};
+  }
+
+  // Times one phase; does nothing if --stats is off.
+  class Timer {
+  private:
+    RunStats *stats;
+
+  public:
+    Timer(RunStats *stats, std::string const &name) : stats(stats) {
+      if (stats) {
+        stats->Begin(name);
+      }
+    }
+    ~Timer() {
+      if (stats) {
+        stats->End();
+      }
+    }
+    Timer(Timer const &) = delete;
+    Timer &operator=(Timer const &) = delete;
+  };
+
+  void Report(std::ostream &out) const {
+    out << std::fixed << std::setprecision(3);
+    out << "phase            wall ms       cpu ms\n";
+    Time total{};
+    for (Phase const &phase : phases) {
+      out << std::left << std::setw(12) << phase.name << std::right
+          << std::setw(12) << phase.self.wall_ms << std::setw(13)
+          << phase.self.cpu_ms << '\n';
+      total += phase.self;
+    }
+    out << std::left << std::setw(12) << "total" << std::right << std::setw(12)
+        << total.wall_ms << std::setw(13) << total.cpu_ms << "\n\n";
+
+    out << std::setprecision(0);
+    if (counters) {
+      ReportCounters(out);
+    }
+
+    double lex_seconds = Get("lex").wall_ms / 1e3;
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    out << "tokens              " << tokens;
+    if (lex_seconds > 0) {
+      out << " (" << static_cast<double>(tokens) / lex_seconds
+          << " tokens/s)";
+    }
+    out << "\nnodes               " << nodes
+        << "\nvariables           " << variables
+        << "\nstatements executed " << statements
+        << "\npeak RSS            " << usage.ru_maxrss << " KB\n";
+    out << std::defaultfloat << std::flush;
+  }
+};
+
+// Parallel for workers count into their own, merged in after the join.
+inline thread_local RunStats *run_stats = nullptr;
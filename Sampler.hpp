@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <signal.h>
+#include <sys/time.h>
+
+#include "ASTNode.hpp"
+#include "Error.hpp"
+
+// Statistical profiler for --sample. A SIGPROF timer fires every so often
+// while the process is using CPU, and the handler charges one sample to the
+// line and node kind of current_statement. Nothing is timed per statement,
+// so the cost is the handler itself (a few atomic increments per tick).
+class Sampler {
+private:
+  static constexpr size_t NUM_KINDS = ASTNode::NUM_TYPES;
+
+  std::string_view source;
+  // sized up front, the handler can't allocate
+  std::vector<std::atomic<uint64_t>> by_line;
+  std::array<std::atomic<uint64_t>, NUM_KINDS> by_kind{};
+  std::atomic<uint64_t> total{};
+  std::atomic<uint64_t> idle{}; // ex. parsing, or a worker thread
+
+  static inline Sampler *active = nullptr;
+
+  static void Handle(int) {
+    Sampler &sampler = *active;
+    sampler.total.fetch_add(1, std::memory_order_relaxed);
+    ASTNode const *node = current_statement.load(std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    if (!node || !node->token) {
+      sampler.idle.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    size_t line = std::min(node->token->line_id, sampler.by_line.size() - 1);
+    sampler.by_line[line].fetch_add(1, std::memory_order_relaxed);
+    size_t kind = std::min<size_t>(node->type, NUM_KINDS - 1);
+    sampler.by_kind[kind].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void SetTimer(long interval_us) {
+    itimerval timer{};
+    timer.it_interval.tv_sec = interval_us / 1000000;
+    timer.it_interval.tv_usec = interval_us % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+  }
+
+public:
+  Sampler(std::string_view source)
+      : source(source),
+        by_line(static_cast<size_t>(std::count(source.begin(), source.end(),
+                                               '\n')) +
+                2) {}
+
+  void Start(unsigned hertz) {
+    active = this;
+    struct sigaction action{};
+    action.sa_handler = Handle;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr) != 0) {
+      ErrorNoLine("Unable to install sampling signal handler");
+    }
+    SetTimer(std::max(1L, 1000000L / static_cast<long>(hertz)));
+  }
+
+  void Stop() {
+    SetTimer(0);
+    signal(SIGPROF, SIG_IGN);
+    active = nullptr;
+  }
+
+  void Report(std::ostream &out) const {
+    uint64_t samples = total.load();
+    out << "Samples: " << samples << " (" << idle.load()
+        << " outside statements)\n";
+    if (samples == 0) {
+      return;
+    }
+    auto percent = [samples](uint64_t count) {
+      return 100.0 * static_cast<double>(count) / static_cast<double>(samples);
+    };
+
+    out << "     line      samples      %  source\n";
+    std::istringstream listing{std::string{source}};
+    std::string text;
+    for (size_t line = 1; std::getline(listing, text); ++line) {
+      uint64_t count = by_line[line].load();
+      if (count) {
+        out << "   " << std::setw(6) << line << std::setw(13) << count
+            << std::fixed << std::setprecision(1) << std::setw(7)
+            << percent(count) << "  " << text << '\n';
+      }
+    }
+
+    out << "\n   kind            samples      %\n";
+    for (size_t kind = 0; kind < NUM_KINDS; ++kind) {
+      uint64_t count = by_kind[kind].load();
+      if (count) {
+        out << "   " << std::left << std::setw(12)
+            << ASTNode::TypeName(static_cast<int>(kind)) << std::right
+            << std::setw(10) << count << std::setw(7) << percent(count)
+            << '\n';
+      }
+    }
+    out << std::defaultfloat << std::flush;
+  }
+};
@@ -1,41 +1,165 @@
 #pragma once
 
+#include <bit>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 #include <iterator>
 #include <optional>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "Array.hpp"
 #include "Error.hpp"
+#include "Tracepoints.hpp"
+
+class ASTNode;
 
 struct VariableInfo {
   std::string name{};
   double value{};
   size_t line_declared{};
   bool initialized = false;
+  AlignedArray elements{}; // empty unless declared as an array
+};
+
+// Results of a pure function, direct-mapped on a hash of the arguments' bit
+// patterns: bounded at SLOTS entries, and a colliding call just replaces the
+// older one.
+class MemoCache {
+private:
+  static constexpr size_t SLOTS = 4096;
+  size_t arity = 0;
+  std::vector<uint64_t> keys{}; // arity per slot
+  std::vector<double> results{};
+  std::vector<bool> used{};
+
+  size_t Slot(std::span<double const> args) const {
+    uint64_t hash = 14695981039346656037ull;
+    for (double arg : args) {
+      hash = (hash ^ std::bit_cast<uint64_t>(arg)) * 1099511628211ull;
+    }
+    // the low bits of a product only see the low bits of its inputs, and
+    // whole numbers leave those zero, so mix the high bits down first
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return static_cast<size_t>(hash % SLOTS);
+  }
+
+  bool Matches(size_t slot, std::span<double const> args) const {
+    for (size_t i = 0; i < arity; ++i) {
+      if (keys[slot * arity + i] != std::bit_cast<uint64_t>(args[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+public:
+  std::optional<double> Find(std::span<double const> args) const {
+    if (used.empty()) {
+      return std::nullopt;
+    }
+    size_t slot = Slot(args);
+    if (used[slot] && Matches(slot, args)) {
+      return results[slot];
+    }
+    return std::nullopt;
+  }
+
+  // true if the result replaced another entry's
+  bool Store(std::span<double const> args, double result) {
+    if (used.empty()) {
+      arity = args.size();
+      keys.resize(SLOTS * arity);
+      results.resize(SLOTS);
+      used.resize(SLOTS);
+    }
+    size_t slot = Slot(args);
+    bool evicted = used[slot] && !Matches(slot, args);
+    for (size_t i = 0; i < arity; ++i) {
+      keys[slot * arity + i] = std::bit_cast<uint64_t>(args[i]);
+    }
+    results[slot] = result;
+    used[slot] = true;
+    return evicted;
+  }
+};
+
+// A user-defined function. Its parameters and locals are ordinary variables
+// numbered [frame_base, frame_base + frame_size), resolved at parse time like
+// any other, so the body reads and writes them with no extra indirection. A
+// call spills the caller's values of that range onto the frame stack and
+// restores them on return, which gives every activation (recursive ones
+// included) its own frame.
+struct FunctionInfo {
+  std::string name{};
+  size_t line_declared{};
+  size_t num_params = 0;
+  size_t frame_base = 0;
+  size_t frame_size = 0;
+  bool pure = false;
+  ASTNode *body = nullptr; // owned by the parser
+  // globals the body can write, directly or through calls, and whether it
+  // can print; for the loop guard and parallel for checks
+  std::vector<size_t> global_writes{};
+  bool prints = false;
+  MemoCache memo{};
+
+  bool IsLocal(size_t var_id) const {
+    return var_id >= frame_base && var_id < frame_base + frame_size;
+  }
 };
 
 class SymbolTable {
 private:
-  typedef std::unordered_map<std::string, size_t> scope_t;
-  std::vector<scope_t> scope_stack{1};
+  // Every name maps to its visible declarations, innermost last, so a lookup
+  // is one hash probe however deeply scopes are nested. Each open scope
+  // remembers the names it declared so closing it can unbind them.
+  struct Binding {
+    size_t var_id;
+    size_t depth; // scope_stack.size() when declared
+  };
+  std::unordered_map<std::string, std::vector<Binding>> bindings{};
+  std::vector<std::vector<std::string>> scope_stack{1};
   std::vector<VariableInfo> all_variables{};
 
+  std::vector<FunctionInfo> functions{};
+  std::unordered_map<std::string, size_t> function_ids{};
+  std::optional<size_t> defining{}; // function whose body is being parsed
+
+  // callers' values of the frames active calls have taken over
+  struct SpilledSlot {
+    double value;
+    bool initialized;
+  };
+  std::vector<SpilledSlot> frame_stack{};
+  size_t call_depth = 0;
+  bool returning = false;
+  double return_value = 0;
+
+  // Set in a parallel for worker's table (see Worker()): names, functions
+  // and memoized results are read from the table the loop runs in.
+  SymbolTable const *shared = nullptr;
+  std::vector<MemoCache> worker_memos{}; // results the worker computed
+
   std::optional<size_t> FindVarMaybe(std::string const &name) const {
-    for (auto curr_scope = scope_stack.rbegin();
-         curr_scope != scope_stack.rend(); curr_scope++) {
-      auto result = curr_scope->find(name);
-      if (result != curr_scope->end()) {
-        return result->second;
-      }
+    auto result = bindings.find(name);
+    if (result != bindings.end() && !result->second.empty()) {
+      return result->second.back().var_id;
     }
     return std::nullopt;
   }
 
 public:
-  void PushScope() { this->scope_stack.emplace_back(); }
+  void PushScope() {
+    this->scope_stack.emplace_back();
+    MC_TRACEPOINT(scope_push, scope_stack.size(), 0);
+  }
 
   void PopScope() {
     if (scope_stack.size() == 0) {
@@ -43,7 +167,26 @@ public:
     } else if (scope_stack.size() == 1) {
       throw std::runtime_error("tried to pop outermost scope");
     }
+    for (std::string const &name : scope_stack.back()) {
+      bindings[name].pop_back();
+    }
     scope_stack.pop_back();
+    MC_TRACEPOINT(scope_pop, scope_stack.size(), 0);
+  }
+
+  size_t ScopeDepth() const { return scope_stack.size(); }
+
+  // unwind any scopes left open by a statement that errored partway through,
+  // dropping a function whose definition it was in the middle of
+  void RestoreScopeDepth(size_t depth) {
+    assert(depth >= 1 && depth <= scope_stack.size());
+    while (scope_stack.size() > depth) {
+      PopScope();
+    }
+    if (defining && depth == 1) {
+      function_ids.erase(functions[*defining].name);
+      defining.reset();
+    }
   }
 
   size_t FindVar(std::string const &name, size_t line_num) const {
@@ -59,17 +202,65 @@ public:
   }
 
   size_t AddVar(std::string const &name, size_t line_num, double value = 0.0) {
-    auto curr_scope = scope_stack.rbegin();
-    if (curr_scope->find(name) != curr_scope->end()) {
+    std::vector<Binding> &visible = bindings[name];
+    if (!visible.empty() && visible.back().depth == scope_stack.size()) {
       Error(line_num, "Redeclaration of variable ", name);
     }
     VariableInfo new_var_info = VariableInfo{name, value, line_num};
     size_t new_index = this->all_variables.size();
     all_variables.push_back(new_var_info);
-    curr_scope->insert({name, new_index});
+    visible.push_back({new_index, scope_stack.size()});
+    scope_stack.back().push_back(name);
     return new_index;
   }
 
+  // `var a[N];`, all zeroes; whole arrays are never uninitialized
+  size_t AddArray(std::string const &name, size_t line_num, size_t length) {
+    size_t var_id = AddVar(name, line_num);
+    all_variables[var_id].elements = AlignedArray{length};
+    all_variables[var_id].initialized = true;
+    return var_id;
+  }
+
+  size_t NumVars() const { return all_variables.size(); }
+
+  bool IsArray(size_t var_id) const {
+    return all_variables[var_id].elements.Length() != 0;
+  }
+  size_t Length(size_t var_id) const {
+    return all_variables[var_id].elements.Length();
+  }
+  AlignedArray &GetArray(size_t var_id) { return all_variables[var_id].elements; }
+  AlignedArray const &GetArray(size_t var_id) const {
+    return all_variables[var_id].elements;
+  }
+
+  // element access with the bounds check; the parser skips it (and uses
+  // GetArray directly) where it has proven the index in range
+  size_t CheckIndex(size_t var_id, double index, Token const &token) const {
+    size_t length = Length(var_id);
+    if (index != std::floor(index)) {
+      Error(token, "array index ", index, " is not an integer");
+    }
+    if (index < 0 || index >= static_cast<double>(length)) {
+      Error(token, "index ", index, " out of bounds for array ",
+            GetName(var_id), " of length ", length);
+    }
+    return static_cast<size_t>(index);
+  }
+
+  double GetElement(size_t var_id, double index, Token const &token) const {
+    return GetArray(var_id)[CheckIndex(var_id, index, token)];
+  }
+
+  void SetElement(size_t var_id, double index, double value, Token const &token) {
+    GetArray(var_id)[CheckIndex(var_id, index, token)] = value;
+  }
+
+  std::string const &GetName(size_t var_id) const {
+    return shared ? shared->GetName(var_id) : all_variables[var_id].name;
+  }
+
   double GetValue(size_t var_id, Token const *token) const {
     if (!all_variables[var_id].initialized) {
       if (token) {
@@ -82,8 +273,146 @@ public:
     return all_variables[var_id].value;
   }
 
+  // checkpoints need the raw state, including uninitialized variables
+  double GetRawValue(size_t var_id) const { return all_variables[var_id].value; }
+
+  bool IsInitialized(size_t var_id) const {
+    return all_variables[var_id].initialized;
+  }
+
+  void RestoreValue(size_t var_id, double value, bool initialized) {
+    all_variables[var_id].value = value;
+    all_variables[var_id].initialized = initialized;
+  }
+
   void SetValue(size_t var_id, double new_value) {
     all_variables[var_id].value = new_value;
     all_variables[var_id].initialized = true;
   }
+
+  // Functions. The body is parsed between BeginFunction and EndFunction, in
+  // a scope of its own, so everything declared there (parameters first)
+  // lands in the function's frame.
+  size_t BeginFunction(std::string const &name, size_t line_num, bool pure) {
+    if (function_ids.contains(name)) {
+      Error(line_num, "Redeclaration of function ", name);
+    }
+    size_t id = functions.size();
+    FunctionInfo info{name, line_num};
+    info.pure = pure;
+    info.frame_base = all_variables.size();
+    functions.push_back(std::move(info));
+    function_ids[name] = id;
+    defining = id;
+    PushScope();
+    return id;
+  }
+
+  void EndFunction() {
+    assert(defining);
+    PopScope();
+    FunctionInfo &info = functions[*defining];
+    info.frame_size = all_variables.size() - info.frame_base;
+    defining.reset();
+  }
+
+  std::optional<size_t> DefiningFunction() const { return defining; }
+
+  size_t FindFunction(std::string const &name, size_t line_num) const {
+    auto result = function_ids.find(name);
+    if (result == function_ids.end()) {
+      Error(line_num, "Unknown function ", name);
+    }
+    return result->second;
+  }
+
+  FunctionInfo &GetFunction(size_t id) {
+    assert(!shared);
+    return functions[id];
+  }
+  FunctionInfo const &GetFunction(size_t id) const {
+    return shared ? shared->GetFunction(id) : functions[id];
+  }
+
+  // A pure function's memo cache. A worker looks in its own, then in the
+  // shared one (which doesn't change while workers run), and stores in its
+  // own. StoreMemo returns whether the result evicted a colliding entry.
+  std::optional<double> FindMemo(size_t id, std::span<double const> args) const {
+    if (!shared) {
+      return functions[id].memo.Find(args);
+    }
+    if (std::optional<double> result = worker_memos[id].Find(args)) {
+      return result;
+    }
+    return shared->FindMemo(id, args);
+  }
+  bool StoreMemo(size_t id, std::span<double const> args, double result) {
+    MemoCache &memo = shared ? worker_memos[id] : functions[id].memo;
+    return memo.Store(args, result);
+  }
+
+  // The table a parallel for worker runs its iterations in. It has its own
+  // copy of every scalar and of the arrays in `written` (the ones the body can
+  // write, function frames included); every other array is a view of this
+  // table's, and nothing else is copied. This table mustn't change while the
+  // worker runs.
+  SymbolTable Worker(std::vector<size_t> const &written) const {
+    SymbolTable worker{};
+    worker.shared = this;
+    worker.worker_memos.resize(functions.size());
+    worker.all_variables.reserve(all_variables.size());
+    for (VariableInfo const &var : all_variables) {
+      worker.all_variables.push_back(
+          {{}, var.value, var.line_declared, var.initialized,
+           AlignedArray::View(var.elements)});
+    }
+    for (size_t var_id : written) {
+      worker.all_variables[var_id].elements = all_variables[var_id].elements;
+    }
+    for (FunctionInfo const &function : functions) {
+      for (size_t i = 0; i < function.frame_size; ++i) {
+        size_t var_id = function.frame_base + i;
+        worker.all_variables[var_id].elements = all_variables[var_id].elements;
+      }
+    }
+    return worker;
+  }
+
+  static constexpr size_t MAX_CALL_DEPTH = 1000;
+
+  // spill the caller's values of the function's frame, leaving it fresh
+  void EnterFrame(FunctionInfo const &info, size_t line_num) {
+    if (call_depth == MAX_CALL_DEPTH) {
+      Error(line_num, "Maximum call depth (", MAX_CALL_DEPTH,
+            ") exceeded calling ", info.name);
+    }
+    ++call_depth;
+    for (size_t i = 0; i < info.frame_size; ++i) {
+      VariableInfo &slot = all_variables[info.frame_base + i];
+      frame_stack.push_back({slot.value, slot.initialized});
+      slot.initialized = false;
+    }
+  }
+
+  void LeaveFrame(FunctionInfo const &info) {
+    for (size_t i = info.frame_size; i-- > 0;) {
+      VariableInfo &slot = all_variables[info.frame_base + i];
+      slot.value = frame_stack.back().value;
+      slot.initialized = frame_stack.back().initialized;
+      frame_stack.pop_back();
+    }
+    --call_depth;
+    returning = false;
+  }
+
+  size_t CallDepth() const { return call_depth; }
+
+  // set by a return statement; enclosing scopes and loops stop when they
+  // see it, back up to the call
+  void Return(double value) {
+    return_value = value;
+    returning = true;
+  }
+  bool Returning() const { return returning; }
+  double ReturnValue() const { return return_value; }
 };
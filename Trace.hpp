@@ -0,0 +1,168 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "Error.hpp"
+#include "lexer.hpp"
+
+// Chrome trace-event output for --trace. Records a span for each front-end
+// phase, each outermost statement, and each loop (WHILE or for) that runs
+// for at least the threshold, plus counter tracks for output bytes and
+// statements per second. The file opens in chrome://tracing, Perfetto or
+// speedscope.
+//
+// Everything is buffered and written at the end; counters are sampled at
+// most every COUNTER_INTERVAL so a long script doesn't produce an event per
+// statement.
+class Tracer {
+public:
+  using clock = std::chrono::steady_clock;
+
+private:
+  struct Event {
+    std::string name;
+    char const *category;
+    char phase; // 'X' for spans, 'C' for counters
+    double ts_us;
+    double value; // duration of a span, or the counter value
+  };
+
+  static constexpr clock::duration COUNTER_INTERVAL =
+      std::chrono::milliseconds(10);
+
+  clock::time_point origin = clock::now();
+  clock::duration loop_threshold;
+  std::vector<Event> events{};
+  size_t depth = 0;
+
+  uint64_t output_bytes = 0;
+  uint64_t statements = 0;
+  uint64_t statements_at_sample = 0;
+  clock::time_point last_sample = origin;
+
+  double Micros(clock::time_point time) const {
+    return std::chrono::duration<double, std::micro>(time - origin).count();
+  }
+
+  void AddSpan(std::string name, char const *category,
+               clock::time_point start, clock::time_point end) {
+    events.push_back({std::move(name), category, 'X', Micros(start),
+                      std::chrono::duration<double, std::micro>(end - start)
+                          .count()});
+  }
+
+  void SampleCounters(clock::time_point now, bool force = false) {
+    if (now - last_sample < COUNTER_INTERVAL && !(force && now > last_sample)) {
+      return;
+    }
+    double seconds =
+        std::chrono::duration<double>(now - last_sample).count();
+    events.push_back({"output bytes", "counter", 'C', Micros(now),
+                      static_cast<double>(output_bytes)});
+    events.push_back(
+        {"statements/s", "counter", 'C', Micros(now),
+         static_cast<double>(statements - statements_at_sample) / seconds});
+    statements_at_sample = statements;
+    last_sample = now;
+  }
+
+public:
+  Tracer(clock::duration loop_threshold) : loop_threshold(loop_threshold) {}
+
+  void CountOutput(size_t bytes) { output_bytes += bytes; }
+
+  // Spans one front-end phase; does nothing if tracing is off.
+  class Phase {
+  private:
+    Tracer *tracer;
+    char const *name;
+    clock::time_point start{};
+
+  public:
+    Phase(Tracer *tracer, char const *name) : tracer(tracer), name(name) {
+      if (tracer) {
+        start = clock::now();
+      }
+    }
+    ~Phase() {
+      if (tracer) {
+        tracer->AddSpan(name, "phase", start, clock::now());
+      }
+    }
+    Phase(Phase const &) = delete;
+    Phase &operator=(Phase const &) = delete;
+  };
+
+  // Wraps one statement; only outermost statements and slow loops end up
+  // in the trace. Does nothing if tracing is off.
+  class Statement {
+  private:
+    Tracer *tracer;
+    char const *kind;
+    emplex::Token const *token;
+    bool is_loop;
+    clock::time_point start{};
+
+  public:
+    Statement(Tracer *tracer, char const *kind, emplex::Token const *token,
+              bool is_loop)
+        : tracer(tracer), kind(kind), token(token), is_loop(is_loop) {
+      if (tracer) {
+        ++tracer->depth;
+        ++tracer->statements;
+        start = clock::now();
+      }
+    }
+    ~Statement() {
+      if (!tracer) {
+        return;
+      }
+      clock::time_point end = clock::now();
+      bool outermost = --tracer->depth == 0;
+      if (outermost || (is_loop && end - start >= tracer->loop_threshold)) {
+        std::string name = kind;
+        if (token) {
+          name += "@L" + std::to_string(token->line_id);
+        }
+        tracer->AddSpan(std::move(name), outermost ? "statement" : "loop",
+                        start, end);
+      }
+      tracer->SampleCounters(end);
+    }
+    Statement(Statement const &) = delete;
+    Statement &operator=(Statement const &) = delete;
+  };
+
+  void Write(std::string const &path) {
+    SampleCounters(clock::now(), true);
+    std::ofstream out(path);
+    if (out.fail()) {
+      ErrorNoLine("Unable to write trace '", path, "'.");
+    }
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+        << "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1,"
+           " \"tid\": 1, \"args\": {\"name\": \"MacroCalc\"}}";
+    out.precision(3);
+    out << std::fixed;
+    for (Event const &event : events) {
+      out << ",\n  {\"name\": \"" << event.name << "\", \"cat\": \""
+          << event.category << "\", \"ph\": \"" << event.phase
+          << "\", \"pid\": 1, \"tid\": 1, \"ts\": " << event.ts_us;
+      if (event.phase == 'X') {
+        out << ", \"dur\": " << event.value << "}";
+      } else {
+        out << ", \"args\": {\"value\": " << event.value << "}}";
+      }
+    }
+    out << "\n]}\n";
+  }
+};
+
+// Only set on the main thread: a parallel for is traced as one statement,
+// and the statements its workers run aren't spanned or counted in
+// statements/s (the loop is one track of events).
+inline thread_local Tracer *tracer = nullptr;
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+
+// Static tracepoints at the interpreter's key points:
+//
+//   token           parser consumed a token      (token id, line)
+//   scope_push      SymbolTable scope pushed     (new depth, 0)
+//   scope_pop       SymbolTable scope popped     (new depth, 0)
+//   statement       statement dispatched         (node type, line)
+//   loop_iteration  WHILE or for iteration       (line, iteration)
+//   print           print emitted                (bytes, line)
+//
+// They're in normal builds, so a production binary can be traced without
+// rebuilding. How they're compiled is picked at build time:
+//   - by default each one is a single predictable branch on a flag that's
+//     off unless MACROCALC_TRACEPOINTS=<path> is set in the environment; then
+//     events go to an in-process ring buffer (the latest RING_SIZE are kept)
+//     that's written to <path> at exit, one `<ns> <name> <arg1> <arg2>` line
+//     each;
+//   - with -DMACROCALC_USDT and <sys/sdt.h> available they're USDT probes
+//     (provider `macrocalc`), a nop until bpftrace or perf attaches;
+//   - with -DMACROCALC_NO_TRACEPOINTS they compile away entirely.
+namespace tracepoints {
+
+enum Probe : uint8_t {
+  token,
+  scope_push,
+  scope_pop,
+  statement,
+  loop_iteration,
+  print,
+  NUM_PROBES
+};
+
+struct Event {
+  uint64_t nanos;
+  uint64_t arg1;
+  uint64_t arg2;
+  Probe probe;
+};
+
+inline constexpr size_t RING_SIZE = size_t{1} << 16;
+
+// A ring slot is a seqlock: its writer sets `sequence` to 2 * n + 1 (n being
+// the event's position in the whole stream) before filling it in and to
+// 2 * n + 2 after. A reader copies the fields between two loads of
+// `sequence` and keeps the copy only if both saw 2 * n + 2, so it never
+// uses an event that's half written, not yet written, or was overwritten by
+// a later lap while being copied. The fields are relaxed atomics so the
+// racing copy is still well defined.
+struct Slot {
+  std::atomic<uint64_t> sequence{0};
+  std::atomic<uint64_t> nanos{0};
+  std::atomic<uint64_t> arg1{0};
+  std::atomic<uint64_t> arg2{0};
+  std::atomic<Probe> probe{token};
+
+  void Write(uint64_t n, Event const &event) {
+    sequence.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    nanos.store(event.nanos, std::memory_order_relaxed);
+    arg1.store(event.arg1, std::memory_order_relaxed);
+    arg2.store(event.arg2, std::memory_order_relaxed);
+    probe.store(event.probe, std::memory_order_relaxed);
+    sequence.store(2 * n + 2, std::memory_order_release);
+  }
+
+  // false if event n isn't intact in this slot
+  bool Read(uint64_t n, Event &event) const {
+    uint64_t before = sequence.load(std::memory_order_acquire);
+    if (before != 2 * n + 2) {
+      return false;
+    }
+    event = {nanos.load(std::memory_order_relaxed),
+             arg1.load(std::memory_order_relaxed),
+             arg2.load(std::memory_order_relaxed),
+             probe.load(std::memory_order_relaxed)};
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return sequence.load(std::memory_order_relaxed) == before;
+  }
+};
+
+inline std::unique_ptr<Slot[]> ring{};
+inline std::atomic<uint64_t> next_slot{0};
+inline char const *dump_path = nullptr;
+
+inline uint64_t Now() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+inline void Dump() {
+  static constexpr char const *NAMES[NUM_PROBES] = {
+      "token", "scope_push", "scope_pop", "statement", "loop_iteration",
+      "print"};
+  FILE *file = std::fopen(dump_path, "w");
+  if (!file) {
+    std::fprintf(stderr, "Unable to write tracepoints to '%s'.\n", dump_path);
+    return;
+  }
+  uint64_t end = next_slot.load();
+  uint64_t begin = end > RING_SIZE ? end - RING_SIZE : 0;
+  for (uint64_t slot = begin; slot < end; ++slot) {
+    Event event{};
+    if (!ring[slot % RING_SIZE].Read(slot, event)) {
+      continue;
+    }
+    std::fprintf(file, "%llu %s %llu %llu\n",
+                 static_cast<unsigned long long>(event.nanos),
+                 NAMES[event.probe],
+                 static_cast<unsigned long long>(event.arg1),
+                 static_cast<unsigned long long>(event.arg2));
+  }
+  std::fclose(file);
+}
+
+inline bool Init() {
+  dump_path = std::getenv("MACROCALC_TRACEPOINTS");
+  if (!dump_path || !*dump_path) {
+    return false;
+  }
+  ring = std::make_unique<Slot[]>(RING_SIZE);
+  std::atexit(Dump);
+  return true;
+}
+
+inline bool const enabled = Init();
+
+// kept out of line so the disabled path stays a compare and a jump
+[[gnu::noinline, gnu::cold]] inline void Record(Probe probe, uint64_t arg1,
+                                                uint64_t arg2) {
+  uint64_t slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+  ring[slot % RING_SIZE].Write(slot, {Now(), arg1, arg2, probe});
+}
+
+} // namespace tracepoints
+
+#if defined(MACROCALC_NO_TRACEPOINTS)
+#define MC_TRACEPOINT(probe, arg1, arg2) ((void)0)
+#elif defined(MACROCALC_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MC_TRACEPOINT(probe, arg1, arg2)                                       \
+  DTRACE_PROBE2(macrocalc, probe, static_cast<uint64_t>(arg1),                 \
+                static_cast<uint64_t>(arg2))
+#else
+#define MC_TRACEPOINT(probe, arg1, arg2)                                       \
+  do {                                                                         \
+    if (__builtin_expect(tracepoints::enabled, 0)) {                           \
+      tracepoints::Record(tracepoints::probe, static_cast<uint64_t>(arg1),     \
+                          static_cast<uint64_t>(arg2));                        \
+    }                                                                          \
+  } while (0)
+#endif
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "../PerfCounters.hpp"
+#include "History.hpp"
+
+// Tiny benchmark harness shared by the bench/ programs. Each benchmark is a
+// function that performs its operation `iterations` times; the harness
+// calibrates the iteration count to a minimum batch time, then repeats the
+// batch to get a spread of per-operation timings. Where perf_event_open is
+// allowed, hardware counters are read across all the repetitions and
+// reported per operation alongside the times. --history=path appends the
+// samples to a benchmark history file (see History.hpp).
+namespace bench {
+
+// keep the optimizer from deleting work whose result is otherwise unused
+template <typename T> inline void DoNotOptimize(T const &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Benchmark {
+  std::string name;
+  std::function<void(uint64_t iterations)> run;
+};
+
+struct Result {
+  std::string name{};
+  uint64_t iterations = 0; // per repetition
+  std::vector<double> ns_per_op{};
+  PerfCounters::Counts events_per_op{};
+
+  double Median() const {
+    std::vector<double> sorted = ns_per_op;
+    std::sort(sorted.begin(), sorted.end());
+    size_t mid = sorted.size() / 2;
+    return sorted.size() % 2 ? sorted[mid] : (sorted[mid - 1] + sorted[mid]) / 2;
+  }
+
+  double Mean() const {
+    double sum = 0;
+    for (double value : ns_per_op) {
+      sum += value;
+    }
+    return sum / static_cast<double>(ns_per_op.size());
+  }
+
+  double StdDev() const {
+    double mean = Mean();
+    double sum = 0;
+    for (double value : ns_per_op) {
+      sum += (value - mean) * (value - mean);
+    }
+    return std::sqrt(sum / static_cast<double>(ns_per_op.size() - 1));
+  }
+
+  double Min() const {
+    return *std::min_element(ns_per_op.begin(), ns_per_op.end());
+  }
+};
+
+struct Options {
+  size_t repetitions = 15;
+  double min_batch_ms = 20;
+  bool json = false;
+  bool counters = true;
+  std::string filter{};
+  std::string history{};
+};
+
+inline double TimeBatch(Benchmark const &benchmark, uint64_t iterations) {
+  auto start = std::chrono::steady_clock::now();
+  benchmark.run(iterations);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count();
+}
+
+inline Result Measure(Benchmark const &benchmark, Options const &options,
+                      PerfCounters const *counters) {
+  // grow the batch until it's long enough for the clock not to matter
+  uint64_t iterations = 1;
+  double min_ns = options.min_batch_ms * 1e6;
+  while (true) {
+    double ns = TimeBatch(benchmark, iterations);
+    if (ns >= min_ns) {
+      break;
+    }
+    double scale = ns > 0 ? std::min(10.0, 1.2 * min_ns / ns) : 10.0;
+    iterations = std::max(iterations + 1,
+                          static_cast<uint64_t>(static_cast<double>(iterations) * scale));
+  }
+
+  Result result{benchmark.name, iterations};
+  PerfCounters::Counts start{};
+  if (counters) {
+    start = counters->Read();
+  }
+  for (size_t rep = 0; rep < options.repetitions; ++rep) {
+    result.ns_per_op.push_back(TimeBatch(benchmark, iterations) /
+                               static_cast<double>(iterations));
+  }
+  if (counters) {
+    result.events_per_op = (counters->Read() - start) /
+                           static_cast<double>(iterations * options.repetitions);
+  }
+  return result;
+}
+
+inline Options ParseOptions(int argc, char *argv[]) {
+  Options options{};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--json") {
+      options.json = true;
+    } else if (arg == "--no-counters") {
+      options.counters = false;
+    } else if (arg.starts_with("--repetitions=")) {
+      options.repetitions = std::max<size_t>(2, std::stoul(arg.substr(14)));
+    } else if (arg.starts_with("--min-batch-ms=")) {
+      options.min_batch_ms = std::stod(arg.substr(15));
+    } else if (arg.starts_with("--filter=")) {
+      options.filter = arg.substr(9);
+    } else if (arg.starts_with("--history=")) {
+      options.history = arg.substr(10);
+    } else {
+      std::cerr << "Format: " << argv[0]
+                << " [--json] [--no-counters] [--repetitions=N]"
+                   " [--min-batch-ms=MS] [--filter=substring]"
+                   " [--history=path]"
+                << std::endl;
+      exit(1);
+    }
+  }
+  return options;
+}
+
+inline void PrintTable(std::vector<Result> const &results) {
+  std::cout << std::left << std::setw(40) << "benchmark" << std::right
+            << std::setw(12) << "median ns" << std::setw(12) << "mean ns"
+            << std::setw(10) << "stddev" << std::setw(12) << "min ns"
+            << std::setw(14) << "iterations" << '\n';
+  std::cout << std::fixed << std::setprecision(2);
+  for (Result const &result : results) {
+    std::cout << std::left << std::setw(40) << result.name << std::right
+              << std::setw(12) << result.Median() << std::setw(12)
+              << result.Mean() << std::setw(10) << result.StdDev()
+              << std::setw(12) << result.Min() << std::setw(14)
+              << result.iterations << '\n';
+  }
+  std::cout << std::defaultfloat;
+}
+
+// one line per benchmark, counts per operation
+inline void PrintCounters(std::vector<Result> const &results,
+                          PerfCounters const &counters) {
+  std::cout << '\n' << std::left << std::setw(40) << "counters per op"
+            << std::right;
+  for (size_t event = 0; event < PerfCounters::NUM_EVENTS; ++event) {
+    std::cout << std::setw(15)
+              << PerfCounters::Name(static_cast<PerfCounters::Event>(event));
+  }
+  std::cout << std::setw(8) << "IPC" << '\n';
+  bool ipc = counters.Available(PerfCounters::CYCLES) &&
+             counters.Available(PerfCounters::INSTRUCTIONS);
+  std::cout << std::fixed;
+  for (Result const &result : results) {
+    std::cout << std::left << std::setw(40) << result.name << std::right
+              << std::setprecision(3);
+    for (size_t event = 0; event < PerfCounters::NUM_EVENTS; ++event) {
+      if (counters.Available(static_cast<PerfCounters::Event>(event))) {
+        std::cout << std::setw(15) << result.events_per_op.values[event];
+      } else {
+        std::cout << std::setw(15) << "n/a";
+      }
+    }
+    if (ipc) {
+      std::cout << std::setw(8) << std::setprecision(2)
+                << result.events_per_op.IPC() << '\n';
+    } else {
+      std::cout << std::setw(8) << "n/a" << '\n';
+    }
+  }
+  std::cout << std::defaultfloat;
+}
+
+inline void PrintJson(std::vector<Result> const &results,
+                      PerfCounters const *counters) {
+  std::cout << "{\"benchmarks\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    Result const &result = results[i];
+    std::cout << (i ? ",\n  " : "\n  ") << "{\"name\": \"" << result.name
+              << "\", \"iterations\": " << result.iterations
+              << ", \"repetitions\": " << result.ns_per_op.size()
+              << std::setprecision(6) << ", \"median_ns\": " << result.Median()
+              << ", \"mean_ns\": " << result.Mean()
+              << ", \"stddev_ns\": " << result.StdDev()
+              << ", \"min_ns\": " << result.Min() << ", \"samples_ns\": [";
+    for (size_t j = 0; j < result.ns_per_op.size(); ++j) {
+      std::cout << (j ? ", " : "") << result.ns_per_op[j];
+    }
+    std::cout << "]";
+    if (counters) {
+      // only the events this machine could count
+      std::cout << ", \"counters_per_op\": {";
+      bool first = true;
+      for (size_t event = 0; event < PerfCounters::NUM_EVENTS; ++event) {
+        auto id = static_cast<PerfCounters::Event>(event);
+        if (counters->Available(id)) {
+          std::cout << (first ? "" : ", ") << '"' << PerfCounters::Name(id)
+                    << "\": " << result.events_per_op[id];
+          first = false;
+        }
+      }
+      std::cout << "}";
+    }
+    std::cout << "}";
+  }
+  std::cout << "\n]}" << std::endl;
+}
+
+inline int Main(int argc, char *argv[],
+                std::vector<Benchmark> const &benchmarks) {
+  Options options = ParseOptions(argc, argv);
+  std::optional<PerfCounters> perf{};
+  if (options.counters) {
+    perf.emplace();
+    if (!perf->AnyAvailable()) {
+      std::cerr << "Hardware counters unavailable; reporting times only."
+                << std::endl;
+      perf.reset();
+    }
+  }
+  PerfCounters const *counters = perf ? &*perf : nullptr;
+
+  std::vector<Result> results{};
+  for (Benchmark const &benchmark : benchmarks) {
+    if (benchmark.name.find(options.filter) != std::string::npos) {
+      results.push_back(Measure(benchmark, options, counters));
+    }
+  }
+  if (options.json) {
+    PrintJson(results, counters);
+  } else {
+    PrintTable(results);
+    if (counters) {
+      PrintCounters(results, *counters);
+    }
+  }
+  if (!options.history.empty()) {
+    history::Writer writer{};
+    for (Result const &result : results) {
+      writer.Add("micro", result.name, "ns_per_op", result.ns_per_op);
+    }
+    if (!writer.Append(options.history)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+} // namespace bench
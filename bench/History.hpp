@@ -0,0 +1,300 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/utsname.h>
+
+// Benchmark history: micro_bench and macro_bench --history=path append one
+// JSON line per benchmark and metric, e.g.
+//
+//   {"commit": "34ec607-dirty", "machine": "9f0c1e2a7b3d4c55",
+//    "machine_desc": "...", "time": 1760000000, "suite": "micro",
+//    "benchmark": "dfa/get_next", "metric": "ns_per_op",
+//    "samples": [1.02, 1.01, ...]}
+//
+// (all on one line). Every metric is lower-is-better. bench/compare reads
+// the file back and compares two commits measured on the same machine.
+namespace history {
+
+struct Record {
+  std::string commit{};
+  std::string machine{};
+  std::string machine_desc{};
+  int64_t time = 0;
+  std::string suite{};
+  std::string benchmark{};
+  std::string metric{};
+  std::vector<double> samples{};
+};
+
+// MACROCALC_COMMIT if set, else what git says about the working tree
+inline std::string CommitHash() {
+  if (char const *commit = std::getenv("MACROCALC_COMMIT"); commit && *commit) {
+    return commit;
+  }
+  std::string out{};
+  if (FILE *pipe = popen("git describe --always --dirty 2>/dev/null", "r")) {
+    char buffer[128];
+    while (std::fgets(buffer, sizeof(buffer), pipe)) {
+      out += buffer;
+    }
+    pclose(pipe);
+  }
+  while (!out.empty() && std::isspace(static_cast<unsigned char>(out.back()))) {
+    out.pop_back();
+  }
+  return out.empty() ? "unknown" : out;
+}
+
+// CPU model, core count, kernel and compiler: results are only comparable
+// when all of these match
+inline std::string MachineDescription() {
+  std::string cpu = "unknown cpu";
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.starts_with("model name")) {
+      size_t colon = line.find(':');
+      if (colon != std::string::npos && colon + 2 <= line.size()) {
+        cpu = line.substr(colon + 2);
+      }
+      break;
+    }
+  }
+  utsname names{};
+  uname(&names);
+  std::ostringstream desc{};
+  desc << cpu << "; " << std::thread::hardware_concurrency() << " cpus; "
+       << names.sysname << " " << names.release << " " << names.machine
+       << "; compiler " << __VERSION__;
+  return desc.str();
+}
+
+// FNV-1a of the description, so machines can be matched at a glance
+inline std::string Fingerprint(std::string const &description) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : description) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  std::ostringstream out{};
+  out << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return out.str();
+}
+
+inline std::string Quote(std::string const &text) {
+  std::string out = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+    }
+    out += c;
+  }
+  return out + '"';
+}
+
+// Collects one run's records; Append() adds them to the history file.
+class Writer {
+private:
+  std::string commit = CommitHash();
+  std::string machine_desc = MachineDescription();
+  std::string machine = Fingerprint(machine_desc);
+  int64_t time = static_cast<int64_t>(std::time(nullptr));
+  std::vector<std::string> lines{};
+
+public:
+  void Add(std::string const &suite, std::string const &benchmark,
+           std::string const &metric, std::vector<double> const &samples) {
+    std::ostringstream line{};
+    line << "{\"commit\": " << Quote(commit) << ", \"machine\": "
+         << Quote(machine) << ", \"machine_desc\": " << Quote(machine_desc)
+         << ", \"time\": " << time << ", \"suite\": " << Quote(suite)
+         << ", \"benchmark\": " << Quote(benchmark)
+         << ", \"metric\": " << Quote(metric) << ", \"samples\": ["
+         << std::setprecision(9);
+    for (size_t i = 0; i < samples.size(); ++i) {
+      line << (i ? ", " : "") << samples[i];
+    }
+    line << "]}";
+    lines.push_back(line.str());
+  }
+
+  bool Append(std::string const &path) const {
+    std::ofstream out(path, std::ios::app);
+    for (std::string const &line : lines) {
+      out << line << '\n';
+    }
+    out.flush();
+    if (out.fail()) {
+      std::cerr << "Unable to append benchmark history to '" << path << "'."
+                << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+// Just enough JSON for the lines Writer produces; nullopt on anything else.
+class LineParser {
+private:
+  std::string const &text;
+  size_t pos = 0;
+
+  void SkipSpace() {
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) {
+      ++pos;
+    }
+  }
+
+  bool Expect(char c) {
+    SkipSpace();
+    if (pos < text.size() && text[pos] == c) {
+      ++pos;
+      return true;
+    }
+    return false;
+  }
+
+  std::optional<std::string> String() {
+    if (!Expect('"')) {
+      return std::nullopt;
+    }
+    std::string out{};
+    while (pos < text.size() && text[pos] != '"') {
+      if (text[pos] == '\\' && pos + 1 < text.size()) {
+        ++pos;
+      }
+      out += text[pos++];
+    }
+    if (pos == text.size()) {
+      return std::nullopt;
+    }
+    ++pos;
+    return out;
+  }
+
+  std::optional<double> Number() {
+    SkipSpace();
+    char const *start = text.c_str() + pos;
+    char *end = nullptr;
+    double value = std::strtod(start, &end);
+    if (end == start) {
+      return std::nullopt;
+    }
+    pos += static_cast<size_t>(end - start);
+    return value;
+  }
+
+  std::optional<std::vector<double>> Numbers() {
+    if (!Expect('[')) {
+      return std::nullopt;
+    }
+    std::vector<double> out{};
+    if (Expect(']')) {
+      return out;
+    }
+    do {
+      std::optional<double> value = Number();
+      if (!value) {
+        return std::nullopt;
+      }
+      out.push_back(*value);
+    } while (Expect(','));
+    if (!Expect(']')) {
+      return std::nullopt;
+    }
+    return out;
+  }
+
+public:
+  explicit LineParser(std::string const &text) : text(text) {}
+
+  std::optional<Record> Parse() {
+    Record record{};
+    if (!Expect('{')) {
+      return std::nullopt;
+    }
+    do {
+      std::optional<std::string> key = String();
+      if (!key || !Expect(':')) {
+        return std::nullopt;
+      }
+      SkipSpace();
+      if (*key == "samples") {
+        std::optional<std::vector<double>> samples = Numbers();
+        if (!samples) {
+          return std::nullopt;
+        }
+        record.samples = *samples;
+      } else if (*key == "time") {
+        std::optional<double> time = Number();
+        if (!time) {
+          return std::nullopt;
+        }
+        record.time = static_cast<int64_t>(*time);
+      } else {
+        std::optional<std::string> value = String();
+        if (!value) {
+          return std::nullopt;
+        }
+        if (*key == "commit") {
+          record.commit = *value;
+        } else if (*key == "machine") {
+          record.machine = *value;
+        } else if (*key == "machine_desc") {
+          record.machine_desc = *value;
+        } else if (*key == "suite") {
+          record.suite = *value;
+        } else if (*key == "benchmark") {
+          record.benchmark = *value;
+        } else if (*key == "metric") {
+          record.metric = *value;
+        }
+      }
+    } while (Expect(','));
+    if (!Expect('}') || record.commit.empty() || record.samples.empty()) {
+      return std::nullopt;
+    }
+    return record;
+  }
+};
+
+// every well-formed line of the file, in order; others are reported and
+// skipped
+inline std::vector<Record> Load(std::string const &path) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Unable to read benchmark history '" << path << "'."
+              << std::endl;
+    exit(1);
+  }
+  std::vector<Record> records{};
+  std::string line;
+  for (size_t line_id = 1; std::getline(in, line); ++line_id) {
+    if (line.empty()) {
+      continue;
+    }
+    if (std::optional<Record> record = LineParser{line}.Parse()) {
+      records.push_back(std::move(*record));
+    } else {
+      std::cerr << path << ":" << line_id << ": skipping malformed record"
+                << std::endl;
+    }
+  }
+  return records;
+}
+
+} // namespace history
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Parametric .Mc programs for macro-benchmarks. Each generator takes a size
+// and returns a complete script; the default sizes are picked so every
+// workload runs for a noticeable fraction of a second, and `scale`
+// multiplies them. Only syntax the parser already accepts is used.
+namespace workloads {
+
+struct Workload {
+  std::string name;
+  std::string description;
+  size_t default_size;
+  std::function<std::string(size_t size)> generate;
+};
+
+// n nested blocks, each declaring a variable and reading the outer one
+inline std::string DeepScopes(size_t n) {
+  std::ostringstream out;
+  out << "var v0 = 0;\n";
+  for (size_t i = 1; i <= n; ++i) {
+    out << "{ var v" << i << " = v" << i - 1 << ";\n";
+  }
+  out << "print(v" << n << ");\n";
+  for (size_t i = 1; i <= n; ++i) {
+    out << "}\n";
+  }
+  return out.str();
+}
+
+// one long straight-line list of assignments
+inline std::string FlatStatements(size_t n) {
+  std::ostringstream out;
+  out << "var x = 0;\nvar y = 1;\n";
+  for (size_t i = 0; i < n; ++i) {
+    out << (i % 2 ? "x = y;\n" : "y = " + std::to_string(i) + ";\n");
+  }
+  out << "print(x);\n";
+  return out.str();
+}
+
+// two nested loops of sqrt(n) iterations each with a small body
+inline std::string NestedLoops(size_t n) {
+  size_t side = 1;
+  while (side * side < n) {
+    ++side;
+  }
+  std::ostringstream out;
+  out << "var i;\nvar j;\nvar k = 0;\n"
+      << "for (i = 0; i < " << side << ") {\n"
+      << "  for (j = 0; j < " << side << ") {\n"
+      << "    var t = j;\n"
+      << "    k = t;\n"
+      << "  }\n"
+      << "}\n"
+      << "print(k);\n";
+  return out.str();
+}
+
+inline std::string PrintHeavy(size_t n) {
+  std::ostringstream out;
+  out << "var i;\n"
+      << "for (i = 0; i < " << n << ") print(\"line {i} of the report: {i}\");\n";
+  return out.str();
+}
+
+// mostly comments and long string literals, with few real statements
+inline std::string CommentsAndStrings(size_t n) {
+  std::ostringstream out;
+  out << "var x = 1;\n";
+  for (size_t i = 0; i < n; ++i) {
+    switch (i % 3) {
+    case 0:
+      out << "// line comment number " << i
+          << " with some extra words to scan past\n";
+      break;
+    case 1:
+      out << "/* block comment " << i << "\n   spanning two lines */\n";
+      break;
+    default:
+      out << "print(\"a fairly long string literal {x} with some words "
+             "and punctuation, in it\");\n";
+    }
+  }
+  return out.str();
+}
+
+// n globals, each declared then read back
+inline std::string ManyVariables(size_t n) {
+  std::ostringstream out;
+  for (size_t i = 0; i < n; ++i) {
+    out << "var v" << i << " = " << i << ";\n";
+  }
+  out << "var sink = 0;\n";
+  for (size_t i = 0; i < n; ++i) {
+    out << "sink = v" << i << ";\n";
+  }
+  out << "print(sink);\n";
+  return out.str();
+}
+
+inline std::vector<Workload> All() {
+  return {
+      {"deep_scopes", "nested blocks", 2000, DeepScopes},
+      {"flat_statements", "straight-line assignments", 200000, FlatStatements},
+      {"nested_loops", "for inside for, total iterations", 4000000,
+       NestedLoops},
+      {"print_heavy", "printing loop", 200000, PrintHeavy},
+      {"comments_strings", "comment and string heavy source", 60000,
+       CommentsAndStrings},
+      {"many_variables", "distinct globals", 50000, ManyVariables},
+  };
+}
+
+} // namespace workloads
@@ -0,0 +1,239 @@
+// Compares two commits in a benchmark history file (see History.hpp).
+// For each benchmark and metric measured under both, it bootstraps the
+// ratio of the candidate's median to the baseline's, and calls a change
+// significant when the whole confidence interval is on one side of 1 and
+// the change is at least --threshold percent. Exits 1 if anything
+// regressed, so it can gate CI.
+//
+// Usage: compare [--history=bench/history.jsonl] [--baseline=commit]
+//                [--candidate=commit] [--confidence=95] [--resamples=2000]
+//                [--threshold=1] [--seed=S]
+//
+// The candidate defaults to the newest commit in the file, and the baseline
+// to the newest other commit measured on the same machine. Samples from
+// repeated runs of one commit are pooled. (`make bench-compare` runs the
+// benchmarks and then this.)
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "History.hpp"
+
+struct Options {
+  std::string history = "bench/history.jsonl";
+  std::string baseline{};
+  std::string candidate{};
+  double confidence = 95;
+  size_t resamples = 2000;
+  double threshold = 1;
+  uint64_t seed = 1;
+};
+
+struct Comparison {
+  double baseline_median = 0;
+  double candidate_median = 0;
+  double ratio = 1;
+  double low = 1;
+  double high = 1;
+};
+
+// (suite, benchmark, metric)
+using Key = std::tuple<std::string, std::string, std::string>;
+
+static double Median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  size_t mid = values.size() / 2;
+  return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+static double ResampledMedian(std::vector<double> const &samples,
+                              std::mt19937_64 &rng) {
+  std::uniform_int_distribution<size_t> pick(0, samples.size() - 1);
+  std::vector<double> resample(samples.size());
+  for (double &value : resample) {
+    value = samples[pick(rng)];
+  }
+  return Median(std::move(resample));
+}
+
+// percentile bootstrap of candidate median / baseline median
+static Comparison Bootstrap(std::vector<double> const &baseline,
+                            std::vector<double> const &candidate,
+                            Options const &options, std::mt19937_64 &rng) {
+  Comparison result{Median(baseline), Median(candidate)};
+  result.ratio = result.candidate_median / result.baseline_median;
+  std::vector<double> ratios{};
+  ratios.reserve(options.resamples);
+  for (size_t i = 0; i < options.resamples; ++i) {
+    ratios.push_back(ResampledMedian(candidate, rng) /
+                     ResampledMedian(baseline, rng));
+  }
+  std::sort(ratios.begin(), ratios.end());
+  double tail = (1 - options.confidence / 100) / 2;
+  auto at = [&ratios](double fraction) {
+    size_t index = static_cast<size_t>(fraction * static_cast<double>(ratios.size() - 1) + 0.5);
+    return ratios[std::min(index, ratios.size() - 1)];
+  };
+  result.low = at(tail);
+  result.high = at(1 - tail);
+  return result;
+}
+
+static Options ParseOptions(int argc, char *argv[]) {
+  Options options{};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&arg](std::string const &name) -> std::string {
+      return arg.starts_with(name + "=") ? arg.substr(name.size() + 1) : "";
+    };
+    if (!value("--history").empty()) {
+      options.history = value("--history");
+    } else if (!value("--baseline").empty()) {
+      options.baseline = value("--baseline");
+    } else if (!value("--candidate").empty()) {
+      options.candidate = value("--candidate");
+    } else if (!value("--confidence").empty()) {
+      options.confidence = std::clamp(std::stod(value("--confidence")), 50.0, 99.9);
+    } else if (!value("--resamples").empty()) {
+      options.resamples = std::max<size_t>(100, std::stoul(value("--resamples")));
+    } else if (!value("--threshold").empty()) {
+      options.threshold = std::stod(value("--threshold"));
+    } else if (!value("--seed").empty()) {
+      options.seed = std::stoull(value("--seed"));
+    } else {
+      std::cerr << "Format: " << argv[0]
+                << " [--history=path] [--baseline=commit] [--candidate=commit]"
+                   " [--confidence=95] [--resamples=2000] [--threshold=1]"
+                   " [--seed=S]"
+                << std::endl;
+      exit(1);
+    }
+  }
+  return options;
+}
+
+int main(int argc, char *argv[]) {
+  Options options = ParseOptions(argc, argv);
+  std::vector<history::Record> records = history::Load(options.history);
+  if (records.empty()) {
+    std::cerr << "No benchmark history in '" << options.history << "'."
+              << std::endl;
+    return 1;
+  }
+
+  // newest record of the candidate decides which machine we compare on
+  if (options.candidate.empty()) {
+    options.candidate = records.back().commit;
+  }
+  std::string machine{};
+  std::string machine_desc{};
+  for (history::Record const &record : records) {
+    if (record.commit == options.candidate) {
+      machine = record.machine;
+      machine_desc = record.machine_desc;
+    }
+  }
+  if (machine.empty()) {
+    std::cerr << "No results for candidate '" << options.candidate << "'."
+              << std::endl;
+    return 1;
+  }
+  if (options.baseline.empty()) {
+    for (auto it = records.rbegin(); it != records.rend(); ++it) {
+      if (it->commit != options.candidate && it->machine == machine) {
+        options.baseline = it->commit;
+        break;
+      }
+    }
+    if (options.baseline.empty()) {
+      std::cerr << "No other commit measured on this machine to compare "
+                << options.candidate << " against." << std::endl;
+      return 1;
+    }
+  }
+
+  std::map<Key, std::vector<double>> baseline{};
+  std::map<Key, std::vector<double>> candidate{};
+  size_t other_machines = 0;
+  for (history::Record const &record : records) {
+    bool is_baseline = record.commit == options.baseline;
+    bool is_candidate = record.commit == options.candidate;
+    if (!is_baseline && !is_candidate) {
+      continue;
+    }
+    if (record.machine != machine) {
+      ++other_machines;
+      continue;
+    }
+    auto &pool = is_candidate ? candidate : baseline;
+    Key key{record.suite, record.benchmark, record.metric};
+    pool[key].insert(pool[key].end(), record.samples.begin(),
+                     record.samples.end());
+  }
+
+  std::cout << "baseline " << options.baseline << " vs candidate "
+            << options.candidate << " on " << machine << " (" << machine_desc
+            << ")\n";
+  if (other_machines) {
+    std::cout << "ignoring " << other_machines
+              << " records from other machines\n";
+  }
+  std::cout << options.confidence << "% bootstrap intervals of the median ratio, "
+            << options.resamples << " resamples, threshold "
+            << options.threshold << "%\n\n";
+  std::cout << std::left << std::setw(48) << "benchmark" << std::right
+            << std::setw(14) << "baseline" << std::setw(14) << "candidate"
+            << std::setw(10) << "change" << std::setw(22) << "interval"
+            << "  verdict\n";
+
+  std::mt19937_64 rng{options.seed};
+  size_t regressions = 0;
+  size_t improvements = 0;
+  size_t compared = 0;
+  std::cout << std::fixed;
+  for (auto const &[key, candidate_samples] : candidate) {
+    auto found = baseline.find(key);
+    if (found == baseline.end()) {
+      continue;
+    }
+    ++compared;
+    auto const &[suite, benchmark, metric] = key;
+    Comparison result =
+        Bootstrap(found->second, candidate_samples, options, rng);
+    double limit = options.threshold / 100;
+    std::string verdict = "~";
+    if (result.low > 1 && result.ratio - 1 >= limit) {
+      verdict = "REGRESSION";
+      ++regressions;
+    } else if (result.high < 1 && 1 - result.ratio >= limit) {
+      verdict = "improvement";
+      ++improvements;
+    }
+    auto percent = [](double ratio) {
+      std::ostringstream out{};
+      out << std::showpos << std::fixed << std::setprecision(1)
+          << (ratio - 1) * 100 << "%";
+      return out.str();
+    };
+    std::cout << std::left << std::setw(48)
+              << suite + "/" + benchmark + " " + metric << std::right
+              << std::setprecision(3) << std::setw(14) << result.baseline_median
+              << std::setw(14) << result.candidate_median << std::setw(10)
+              << percent(result.ratio) << std::setw(22)
+              << "[" + percent(result.low) + ", " + percent(result.high) + "]"
+              << "  " << verdict << '\n';
+  }
+  std::cout << std::defaultfloat << '\n'
+            << compared << " compared: " << regressions << " regressions, "
+            << improvements << " improvements" << std::endl;
+  return regressions ? 1 : 0;
+}
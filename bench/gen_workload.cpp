@@ -0,0 +1,34 @@
+// Writes one synthetic .Mc workload to stdout.
+//
+// Usage: gen_workload <name> [size]
+//        gen_workload --list
+
+#include <iostream>
+#include <string>
+
+#include "Workloads.hpp"
+
+int main(int argc, char *argv[]) {
+  if (argc == 2 && std::string{argv[1]} == "--list") {
+    for (workloads::Workload const &workload : workloads::All()) {
+      std::cout << workload.name << " (" << workload.description
+                << ", default size " << workload.default_size << ")\n";
+    }
+    return 0;
+  }
+  if (argc != 2 && argc != 3) {
+    std::cerr << "Format: " << argv[0] << " [name] [size] | --list"
+              << std::endl;
+    return 1;
+  }
+  for (workloads::Workload const &workload : workloads::All()) {
+    if (workload.name == argv[1]) {
+      size_t size = argc == 3 ? std::stoul(argv[2]) : workload.default_size;
+      std::cout << workload.generate(size);
+      return 0;
+    }
+  }
+  std::cerr << "Unknown workload '" << argv[1] << "' (see --list)"
+            << std::endl;
+  return 1;
+}
@@ -0,0 +1,327 @@
+// Generates the synthetic workload corpus and runs each script through
+// Project2, recording wall time, CPU time and peak memory per workload.
+// Each workload is then run once more in a forked child using the
+// interpreter compiled into this program, to read hardware counters per
+// phase (lex, string-lex, parse, execute); --no-counters skips that, and it
+// is skipped anyway where perf_event_open isn't allowed. --history=path
+// appends the wall and CPU time samples to a benchmark history file.
+//
+// Usage: macro_bench [--project=./Project2] [--corpus=bench/corpus]
+//                    [--scale=X] [--repetitions=N] [--filter=substring]
+//                    [--json] [--no-counters] [--history=path]
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../MacroCalc.hpp"
+#include "../PerfCounters.hpp"
+#include "../RunStats.hpp"
+#include "History.hpp"
+#include "Workloads.hpp"
+
+struct Run {
+  double wall_ms = 0;
+  double cpu_ms = 0;
+  long max_rss_kb = 0;
+  int status = 0;
+};
+
+struct Options {
+  std::string project = "./Project2";
+  std::string corpus = "bench/corpus";
+  double scale = 1.0;
+  size_t repetitions = 5;
+  std::string filter{};
+  bool json = false;
+  bool counters = true;
+  std::string history{};
+};
+
+static constexpr std::array<char const *, 4> PHASES = {"lex", "string-lex",
+                                                       "parse", "execute"};
+using PhaseCounts = std::array<PerfCounters::Counts, PHASES.size()>;
+
+static double Millis(timeval const &time) {
+  return static_cast<double>(time.tv_sec) * 1e3 +
+         static_cast<double>(time.tv_usec) / 1e3;
+}
+
+// runs the interpreter on one script with stdout discarded
+static Run RunOnce(std::string const &project, std::string const &script) {
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    std::cerr << "fork failed" << std::endl;
+    exit(1);
+  }
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    execl(project.c_str(), project.c_str(), script.c_str(),
+          static_cast<char *>(nullptr));
+    _exit(127);
+  }
+  Run run{};
+  rusage usage{};
+  wait4(pid, &run.status, 0, &usage);
+  run.wall_ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  run.cpu_ms = Millis(usage.ru_utime) + Millis(usage.ru_stime);
+  run.max_rss_kb = usage.ru_maxrss;
+  return run;
+}
+
+// Runs one script in-process in a child with counters on and gets the
+// per-phase counts back over a pipe; nullopt if the child fails or no
+// counters could be opened.
+static std::optional<PhaseCounts> CountPhases(std::string const &script) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return std::nullopt;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return std::nullopt;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    RunStats stats{};
+    if (!stats.EnableCounters()) {
+      _exit(2);
+    }
+    run_stats = &stats;
+    MacroCalc calc{script};
+    calc.Execute();
+    std::cout.flush();
+    run_stats = nullptr;
+    PhaseCounts counts{};
+    for (size_t phase = 0; phase < PHASES.size(); ++phase) {
+      counts[phase] = stats.Get(PHASES[phase]).events;
+    }
+    bool sent = write(fds[1], &counts, sizeof(counts)) == sizeof(counts);
+    _exit(sent ? 0 : 1);
+  }
+  close(fds[1]);
+  PhaseCounts counts{};
+  bool received = read(fds[0], &counts, sizeof(counts)) == sizeof(counts);
+  close(fds[0]);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (!received || status != 0) {
+    return std::nullopt;
+  }
+  return counts;
+}
+
+// the events this machine can count, as JSON
+static void PrintCountsJson(PerfCounters::Counts const &counts,
+                            PerfCounters const &probe) {
+  std::cout << "{";
+  bool first = true;
+  for (size_t event = 0; event < PerfCounters::NUM_EVENTS; ++event) {
+    auto id = static_cast<PerfCounters::Event>(event);
+    if (probe.Available(id)) {
+      std::cout << (first ? "" : ", ") << '"' << PerfCounters::Name(id)
+                << "\": " << counts[id];
+      first = false;
+    }
+  }
+  std::cout << "}";
+}
+
+static void PrintCountsTable(
+    std::vector<std::pair<std::string, PhaseCounts>> const &results,
+    PerfCounters const &probe) {
+  std::cout << '\n' << std::left << std::setw(32) << "workload/phase"
+            << std::right;
+  for (size_t event = 0; event < PerfCounters::NUM_EVENTS; ++event) {
+    std::cout << std::setw(15)
+              << PerfCounters::Name(static_cast<PerfCounters::Event>(event));
+  }
+  std::cout << std::setw(8) << "IPC" << '\n';
+  bool ipc = probe.Available(PerfCounters::CYCLES) &&
+             probe.Available(PerfCounters::INSTRUCTIONS);
+  for (auto const &[name, counts] : results) {
+    for (size_t phase = 0; phase < PHASES.size(); ++phase) {
+      std::cout << std::left << std::setw(32)
+                << name + "/" + PHASES[phase] << std::right
+                << std::setprecision(0);
+      for (size_t event = 0; event < PerfCounters::NUM_EVENTS; ++event) {
+        if (probe.Available(static_cast<PerfCounters::Event>(event))) {
+          std::cout << std::setw(15) << counts[phase].values[event];
+        } else {
+          std::cout << std::setw(15) << "n/a";
+        }
+      }
+      if (ipc) {
+        std::cout << std::setw(8) << std::setprecision(2)
+                  << counts[phase].IPC() << '\n';
+      } else {
+        std::cout << std::setw(8) << "n/a" << '\n';
+      }
+    }
+  }
+}
+
+static double Median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  size_t mid = values.size() / 2;
+  return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+static Options ParseOptions(int argc, char *argv[]) {
+  Options options{};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&arg](std::string const &name) -> std::string {
+      return arg.starts_with(name + "=") ? arg.substr(name.size() + 1) : "";
+    };
+    if (arg == "--json") {
+      options.json = true;
+    } else if (arg == "--no-counters") {
+      options.counters = false;
+    } else if (!value("--project").empty()) {
+      options.project = value("--project");
+    } else if (!value("--corpus").empty()) {
+      options.corpus = value("--corpus");
+    } else if (!value("--scale").empty()) {
+      options.scale = std::stod(value("--scale"));
+    } else if (!value("--repetitions").empty()) {
+      options.repetitions = std::max<size_t>(1, std::stoul(value("--repetitions")));
+    } else if (!value("--filter").empty()) {
+      options.filter = value("--filter");
+    } else if (!value("--history").empty()) {
+      options.history = value("--history");
+    } else {
+      std::cerr << "Format: " << argv[0]
+                << " [--project=path] [--corpus=dir] [--scale=X]"
+                   " [--repetitions=N] [--filter=substring] [--json]"
+                   " [--no-counters] [--history=path]"
+                << std::endl;
+      exit(1);
+    }
+  }
+  return options;
+}
+
+int main(int argc, char *argv[]) {
+  Options options = ParseOptions(argc, argv);
+  std::filesystem::create_directories(options.corpus);
+
+  std::optional<PerfCounters> probe{};
+  if (options.counters) {
+    probe.emplace();
+    if (!probe->AnyAvailable()) {
+      std::cerr << "Hardware counters unavailable; reporting times only."
+                << std::endl;
+      probe.reset();
+    }
+  }
+  std::vector<std::pair<std::string, PhaseCounts>> phase_counts{};
+  history::Writer writer{};
+
+  if (options.json) {
+    std::cout << "{\"workloads\": [";
+  } else {
+    std::cout << std::left << std::setw(20) << "workload" << std::right
+              << std::setw(10) << "size" << std::setw(12) << "bytes"
+              << std::setw(12) << "wall ms" << std::setw(12) << "cpu ms"
+              << std::setw(12) << "max RSS KB" << '\n';
+  }
+
+  bool first = true;
+  int failures = 0;
+  for (workloads::Workload const &workload : workloads::All()) {
+    if (workload.name.find(options.filter) == std::string::npos) {
+      continue;
+    }
+    size_t size = std::max<size_t>(
+        1, static_cast<size_t>(static_cast<double>(workload.default_size) *
+                               options.scale));
+    std::string script = workload.generate(size);
+    std::string path = options.corpus + "/" + workload.name + ".Mc";
+    std::ofstream(path) << script;
+
+    std::vector<double> wall{};
+    std::vector<double> cpu{};
+    long max_rss_kb = 0;
+    int status = 0;
+    for (size_t rep = 0; rep < options.repetitions; ++rep) {
+      Run run = RunOnce(options.project, path);
+      wall.push_back(run.wall_ms);
+      cpu.push_back(run.cpu_ms);
+      max_rss_kb = std::max(max_rss_kb, run.max_rss_kb);
+      status = status ? status : run.status;
+    }
+    if (!status) {
+      writer.Add("macro", workload.name, "wall_ms", wall);
+      writer.Add("macro", workload.name, "cpu_ms", cpu);
+    }
+    if (status) {
+      ++failures;
+      std::cerr << workload.name << ": " << options.project
+                << " exited with status " << status << std::endl;
+    }
+    std::optional<PhaseCounts> counts{};
+    if (probe && !status) {
+      counts = CountPhases(script);
+      if (counts) {
+        phase_counts.emplace_back(workload.name, *counts);
+      }
+    }
+
+    std::cout << std::fixed << std::setprecision(3);
+    if (options.json) {
+      std::cout << (first ? "\n  " : ",\n  ") << "{\"name\": \""
+                << workload.name << "\", \"size\": " << size
+                << ", \"bytes\": " << script.size()
+                << ", \"repetitions\": " << options.repetitions
+                << ", \"wall_ms\": " << Median(wall)
+                << ", \"cpu_ms\": " << Median(cpu)
+                << ", \"max_rss_kb\": " << max_rss_kb
+                << ", \"ok\": " << (status ? "false" : "true");
+      if (counts) {
+        std::cout << std::setprecision(0) << ", \"counters\": {";
+        for (size_t phase = 0; phase < PHASES.size(); ++phase) {
+          std::cout << (phase ? ", " : "") << '"' << PHASES[phase] << "\": ";
+          PrintCountsJson((*counts)[phase], *probe);
+        }
+        std::cout << "}";
+      }
+      std::cout << "}";
+    } else {
+      std::cout << std::left << std::setw(20) << workload.name << std::right
+                << std::setw(10) << size << std::setw(12) << script.size()
+                << std::setw(12) << Median(wall) << std::setw(12)
+                << Median(cpu) << std::setw(12) << max_rss_kb << '\n';
+    }
+    first = false;
+  }
+  if (options.json) {
+    std::cout << "\n]}" << std::endl;
+  } else if (!phase_counts.empty()) {
+    PrintCountsTable(phase_counts, *probe);
+  }
+  if (!options.history.empty() && !writer.Append(options.history)) {
+    return 1;
+  }
+  return failures;
+}
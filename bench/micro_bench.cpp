@@ -0,0 +1,200 @@
+// Micro-benchmarks for the interpreter's building blocks, run in isolation.
+//
+// Usage: micro_bench [--json] [--no-counters] [--repetitions=N]
+//                    [--min-batch-ms=MS] [--filter=substring] [--history=path]
+// (`make bench` builds and runs it, adding to bench/history.jsonl.)
+
+#include <string>
+#include <vector>
+
+#include "../ASTNode.hpp"
+#include "../Builtins.hpp"
+#include "../SymbolTable.hpp"
+#include "../lexer.hpp"
+#include "../string_lexer.hpp"
+#include "Bench.hpp"
+
+// a little of everything the lexer has to recognize
+static std::string const SAMPLE_SOURCE = R"(// running totals
+var total = 0;
+var count = 10;
+/* block comment
+   spanning lines */
+while (count) {
+  var step = count * 2.5 + 1;
+  total = total + step;
+  print("total is {total}\n");
+  count = count - 1;
+}
+if (total >= 100 && count != 3) print(total); else print("small");
+)";
+
+static std::vector<bench::Benchmark> DfaBenchmarks() {
+  return {{"dfa/get_next", [](uint64_t iterations) {
+             int state = 0;
+             size_t pos = 0;
+             for (uint64_t i = 0; i < iterations; ++i) {
+               state = emplex::DFA::GetNext(state, SAMPLE_SOURCE[pos]);
+               if (state < 0) {
+                 state = 0;
+               }
+               if (++pos == SAMPLE_SOURCE.size()) {
+                 pos = 0;
+               }
+             }
+             bench::DoNotOptimize(state);
+           }}};
+}
+
+static std::vector<bench::Benchmark> LexerBenchmarks() {
+  return {
+      {"lexer/next_token", [](uint64_t iterations) {
+         // one op is one token, restarting at the top of the source at EOF
+         emplex::Lexer lexer{};
+         for (uint64_t i = 0; i < iterations; ++i) {
+           emplex::Token token = lexer.NextToken(SAMPLE_SOURCE);
+           if (token.id == 0) {
+             lexer = emplex::Lexer{};
+           }
+           bench::DoNotOptimize(token);
+         }
+       }},
+      {"string_lexer/tokenize_print_string", [](uint64_t iterations) {
+         emplex2::StringLexer lexer{};
+         std::string text = "value {x} is {result}\\n and \\\"done\\\"";
+         for (uint64_t i = 0; i < iterations; ++i) {
+           bench::DoNotOptimize(lexer.Tokenize(text));
+         }
+       }}};
+}
+
+// `depth` scopes pushed on top of the global one, a few variables in each,
+// looking up a global from the innermost
+static bench::Benchmark FindVarAtDepth(size_t depth) {
+  return {"symbol_table/find_var/depth_" + std::to_string(depth),
+          [depth](uint64_t iterations) {
+            SymbolTable table{};
+            table.AddVar("target", 1);
+            for (size_t scope = 0; scope < depth; ++scope) {
+              table.PushScope();
+              for (size_t var = 0; var < 4; ++var) {
+                table.AddVar("v" + std::to_string(var), 1);
+              }
+            }
+            std::string const name = "target";
+            for (uint64_t i = 0; i < iterations; ++i) {
+              bench::DoNotOptimize(table.FindVar(name, 1));
+            }
+          }};
+}
+
+static std::vector<bench::Benchmark> SymbolTableBenchmarks() {
+  std::vector<bench::Benchmark> benchmarks{};
+  for (size_t depth : {0, 1, 4, 16, 64}) {
+    benchmarks.push_back(FindVarAtDepth(depth));
+  }
+  benchmarks.push_back(
+      {"symbol_table/scope_churn", [](uint64_t iterations) {
+         // one op is push, declare two variables, pop; the table is rebuilt
+         // now and then since variables are never freed
+         SymbolTable table{};
+         for (uint64_t i = 0; i < iterations; ++i) {
+           if (i % 1024 == 0) {
+             table = SymbolTable{};
+           }
+           table.PushScope();
+           table.AddVar("a", 1);
+           table.AddVar("b", 1);
+           table.PopScope();
+         }
+         bench::DoNotOptimize(table);
+       }});
+  benchmarks.push_back({"symbol_table/get_set_value", [](uint64_t iterations) {
+                          SymbolTable table{};
+                          size_t var_id = table.AddVar("x", 1);
+                          table.SetValue(var_id, 0);
+                          for (uint64_t i = 0; i < iterations; ++i) {
+                            table.SetValue(var_id,
+                                           table.GetValue(var_id, nullptr) + 1);
+                          }
+                          bench::DoNotOptimize(table.GetValue(var_id, nullptr));
+                        }});
+  return benchmarks;
+}
+
+static bench::Benchmark RunShape(std::string const &name, ASTNode node,
+                                 SymbolTable table) {
+  return {"ast_run/" + name, [node, table](uint64_t iterations) mutable {
+            for (uint64_t i = 0; i < iterations; ++i) {
+              bench::DoNotOptimize(node.Run(table));
+            }
+          }};
+}
+
+static std::vector<bench::Benchmark> AstBenchmarks() {
+  static emplex::Token const token{Lexer::ID_ID, "x", 1};
+  SymbolTable table{};
+  size_t x = table.AddVar("x", 1);
+  size_t y = table.AddVar("y", 1);
+  table.SetValue(x, 1);
+
+  ASTNode assign{ASTNode::ASSIGN};
+  assign.token = &token;
+  assign.AddChildren(ASTNode(ASTNode::IDENTIFIER, y, &token),
+                     ASTNode(ASTNode::IDENTIFIER, x, &token));
+
+  ASTNode scope{ASTNode::SCOPE};
+  for (int i = 0; i < 4; ++i) {
+    scope.AddChild(assign);
+  }
+
+  return {RunShape("number", ASTNode(ASTNode::NUMBER, 2.5), table),
+          RunShape("identifier", ASTNode(ASTNode::IDENTIFIER, x, &token), table),
+          RunShape("assign", assign, table),
+          RunShape("scope_of_4_assigns", scope, table)};
+}
+
+// one block of kernels::BLOCK elements per op, element by element through
+// the scalar form and all at once through the batched one
+static std::vector<bench::Benchmark> MathBenchmarks() {
+  AlignedArray input{kernels::BLOCK};
+  for (size_t i = 0; i < input.Length(); ++i) {
+    input[i] = 0.37 * static_cast<double>(i) - 40;
+  }
+  std::vector<bench::Benchmark> benchmarks{};
+  for (size_t id = 0; id < builtins::NUM_BUILTINS; ++id) {
+    std::string name{builtins::NAMES[id]};
+    auto builtin = static_cast<builtins::Id>(id);
+    benchmarks.push_back(
+        {"math/" + name + "_scalar", [input, builtin](uint64_t iterations) {
+           AlignedArray output{input.Length()};
+           for (uint64_t i = 0; i < iterations; ++i) {
+             for (size_t j = 0; j < input.Length(); ++j) {
+               output[j] = builtins::Scalar(builtin, input[j]);
+             }
+             bench::DoNotOptimize(output[0]);
+           }
+         }});
+    benchmarks.push_back(
+        {"math/" + name + "_batch", [input, builtin](uint64_t iterations) {
+           AlignedArray output{input.Length()};
+           for (uint64_t i = 0; i < iterations; ++i) {
+             builtins::Batch(builtin, output.Data(), input.Data(),
+                             input.Length());
+             bench::DoNotOptimize(output[0]);
+           }
+         }});
+  }
+  return benchmarks;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<bench::Benchmark> benchmarks{};
+  for (auto group : {DfaBenchmarks, LexerBenchmarks, SymbolTableBenchmarks,
+                     AstBenchmarks, MathBenchmarks}) {
+    for (bench::Benchmark &benchmark : group()) {
+      benchmarks.push_back(benchmark);
+    }
+  }
+  return bench::Main(argc, argv, benchmarks);
+}
@@ -0,0 +1,77 @@
+// mcstat: print the live counters of a running `Project2 --live-stats`.
+//
+// Usage: mcstat <pid> [interval_seconds]
+// With an interval, keeps printing until the process's segment goes away.
+
+#include <charconv>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "LiveStats.hpp"
+
+// returns false once the segment is gone (the script exited)
+bool PrintStats(std::string const &name) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+  void *memory =
+      mmap(nullptr, sizeof(LiveStats), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  LiveStats const &stats = *static_cast<LiveStats const *>(memory);
+  if (stats.magic != LiveStats::MAGIC ||
+      stats.version != LiveStats::VERSION) {
+    ErrorNoLine("'", name, "' is not a MacroCalc stats segment");
+  }
+  auto get = [](std::atomic<uint64_t> const &counter) {
+    return counter.load(std::memory_order_relaxed);
+  };
+  std::cout << "line " << get(stats.current_line)
+            << "  statements " << get(stats.statements)
+            << "  loop_iterations " << get(stats.loop_iterations)
+            << "  prints " << get(stats.prints)
+            << "  bytes_written " << get(stats.bytes_written) << std::endl;
+  munmap(memory, sizeof(LiveStats));
+  return true;
+}
+
+// the whole of `text` as a number, or false
+template <typename T> bool ParseNumber(std::string_view text, T &value) {
+  auto [end, error] =
+      std::from_chars(text.data(), text.data() + text.size(), value);
+  return error == std::errc{} && end == text.data() + text.size();
+}
+
+int main(int argc, char *argv[]) {
+  pid_t pid = 0;
+  double interval_seconds = 0;
+  if ((argc != 2 && argc != 3) || !ParseNumber(argv[1], pid) || pid <= 0 ||
+      (argc == 3 &&
+       (!ParseNumber(argv[2], interval_seconds) || !(interval_seconds > 0)))) {
+    ErrorNoLine("Format: ", argv[0], " [pid] [interval_seconds]");
+  }
+  std::string name = LiveStats::SegmentName(pid);
+  if (!PrintStats(name)) {
+    ErrorNoLine("No live stats for process ", argv[1],
+                " (was it started with --live-stats?)");
+  }
+  if (argc == 3) {
+    std::chrono::duration<double> interval{interval_seconds};
+    while (true) {
+      std::this_thread::sleep_for(interval);
+      if (!PrintStats(name)) {
+        break;
+      }
+    }
+  }
+}
@@ -0,0 +1,396 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../Error.hpp"
+#include "../MacroCalc.hpp"
+
+// Random program generator for differential testing, driven by grammar.txt.
+//
+// The grammar is read at startup and expanded top-down from S, picking
+// alternatives at random; past a depth budget only the alternative that
+// finishes soonest is taken, so expansion always ends. A few things need
+// meaning the grammar can't express:
+//   - `ident` is a fresh name after `var`, the loop variable (both times) in
+//     a FOR, a visible variable as an assignment or reduction target, and a
+//     visible, initialized variable when read;
+//   - literal numbers are small, so loop bounds are too;
+//   - LOOP comes out as `while (x) { { S } x = 0; }`, which always ends.
+// The grammar covers more than the parser accepts so far, so each top-level
+// statement goes through the real front end and is regenerated if it
+// doesn't parse; as the parser grows, so do the programs.
+namespace progen {
+
+struct Symbol {
+  std::string text;
+  bool terminal;
+};
+
+using Alternative = std::vector<Symbol>;
+
+class Grammar {
+private:
+  std::map<std::string, std::vector<Alternative>> rules{};
+  std::map<std::string, size_t> min_depth{};
+
+  static constexpr size_t UNREACHABLE = std::numeric_limits<size_t>::max();
+
+  // how deep the shallowest complete expansion of each nonterminal goes
+  void ComputeMinDepths() {
+    for (auto const &[name, alternatives] : rules) {
+      min_depth[name] = UNREACHABLE;
+    }
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (auto const &[name, alternatives] : rules) {
+        for (Alternative const &alternative : alternatives) {
+          size_t depth = AlternativeDepth(alternative);
+          if (depth < min_depth[name]) {
+            min_depth[name] = depth;
+            changed = true;
+          }
+        }
+      }
+    }
+  }
+
+public:
+  static Grammar Load(std::string const &path) {
+    std::ifstream in(path);
+    if (in.fail()) {
+      ErrorNoLine("Unable to open grammar '", path, "'.");
+    }
+    std::string const arrow = "→";
+    std::string const quote = "’";
+
+    Grammar grammar{};
+    std::string line;
+    while (std::getline(in, line)) {
+      size_t arrow_pos = line.find(arrow);
+      if (line.starts_with("#") || arrow_pos == std::string::npos) {
+        continue;
+      }
+      std::istringstream lhs{line.substr(0, arrow_pos)};
+      std::string name;
+      lhs >> name;
+      std::istringstream rhs{line.substr(arrow_pos + arrow.size())};
+      std::vector<Alternative> &alternatives = grammar.rules[name];
+      alternatives.emplace_back();
+      std::string word;
+      while (rhs >> word) {
+        if (word == "|") {
+          alternatives.emplace_back();
+        } else if (word == "ε") {
+          continue;
+        } else if (word.starts_with(quote) && word.ends_with(quote) &&
+                   word.size() > 2 * quote.size()) {
+          alternatives.back().push_back(
+              {word.substr(quote.size(), word.size() - 2 * quote.size()),
+               true});
+        } else {
+          // nonterminal or named terminal; sorted out once every rule is in
+          alternatives.back().push_back({word, false});
+        }
+      }
+    }
+    for (auto &[name, alternatives] : grammar.rules) {
+      for (Alternative &alternative : alternatives) {
+        for (Symbol &symbol : alternative) {
+          symbol.terminal = symbol.terminal || !grammar.rules.contains(symbol.text);
+        }
+      }
+    }
+    grammar.ComputeMinDepths();
+    return grammar;
+  }
+
+  bool Has(std::string const &name) const { return rules.contains(name); }
+
+  std::vector<Alternative> const &Alternatives(std::string const &name) const {
+    return rules.at(name);
+  }
+
+  size_t AlternativeDepth(Alternative const &alternative) const {
+    size_t depth = 0;
+    for (Symbol const &symbol : alternative) {
+      if (!symbol.terminal) {
+        size_t inner = min_depth.at(symbol.text);
+        if (inner == UNREACHABLE) {
+          return UNREACHABLE;
+        }
+        depth = std::max(depth, inner + 1);
+      }
+    }
+    return depth;
+  }
+};
+
+class Generator {
+private:
+  struct Var {
+    std::string name;
+    bool initialized;
+  };
+
+  // everything a rejected statement has to roll back
+  struct State {
+    std::vector<std::vector<Var>> scopes{{}};
+    size_t next_name = 0;
+  };
+
+  Grammar const &grammar;
+  std::mt19937_64 rng;
+  size_t max_depth;
+  State state{};
+  std::vector<std::string> out{};
+
+  // filled in while a DECL or FOR is being expanded
+  std::string declaring{};
+  bool declared_initialized = false;
+  std::vector<std::string> loop_vars{};
+
+  bool Chance(double probability) {
+    return std::uniform_real_distribution<double>{0, 1}(rng) < probability;
+  }
+
+  template <typename T> T const &Pick(std::vector<T> const &items) {
+    return items[std::uniform_int_distribution<size_t>{0, items.size() - 1}(rng)];
+  }
+
+  std::vector<std::string> Visible(bool initialized_only) const {
+    std::vector<std::string> names{};
+    for (auto const &scope : state.scopes) {
+      for (Var const &var : scope) {
+        if (var.initialized || !initialized_only) {
+          names.push_back(var.name);
+        }
+      }
+    }
+    return names;
+  }
+
+  void MarkInitialized(std::string const &name) {
+    for (auto scope = state.scopes.rbegin(); scope != state.scopes.rend();
+         ++scope) {
+      for (Var &var : *scope) {
+        if (var.name == name) {
+          var.initialized = true;
+          return;
+        }
+      }
+    }
+  }
+
+  std::string Number() {
+    int whole = std::uniform_int_distribution<int>{0, 9}(rng);
+    return Chance(0.1) ? std::to_string(whole) + ".5" : std::to_string(whole);
+  }
+
+  std::string String() {
+    static std::vector<std::string> const words = {"a", "value", "is", "x",
+                                                   "=", "done", "and"};
+    std::string text = "\"";
+    size_t count = std::uniform_int_distribution<size_t>{1, 4}(rng);
+    std::vector<std::string> readable = Visible(true);
+    for (size_t i = 0; i < count; ++i) {
+      text += i ? " " : "";
+      if (!readable.empty() && Chance(0.3)) {
+        text += "{" + Pick(readable) + "}";
+      } else {
+        text += Pick(words);
+      }
+    }
+    return text + "\"";
+  }
+
+  std::string Ident(std::string const &rule) {
+    if (rule == "DECL") {
+      declaring = "v" + std::to_string(state.next_name++);
+      return declaring;
+    }
+    if (rule == "FOR") {
+      // the second ident in a FOR repeats the loop variable
+      if (loop_vars.back().empty()) {
+        std::vector<std::string> visible = Visible(false);
+        loop_vars.back() = visible.empty() ? "v0" : Pick(visible);
+      }
+      return loop_vars.back();
+    }
+    std::vector<std::string> names = Visible(rule == "TERM");
+    if (names.empty()) {
+      return rule == "TERM" ? Number() : "v0";
+    }
+    return Pick(names);
+  }
+
+  void Emit(Symbol const &symbol, std::string const &rule) {
+    static std::map<std::string, std::string> const spellings = {
+        {"or", "||"}, {"and", "&&"}, {"neq", "!="}, {"eq", "=="},
+        {"geq", ">="}, {"leq", "<="}, {"exp", "**"}};
+    std::string const &text = symbol.text;
+    if (text == "ident") {
+      out.push_back(Ident(rule));
+    } else if (text == "literal_num") {
+      out.push_back(Number());
+    } else if (text == "literal_str") {
+      out.push_back(String());
+    } else if (spellings.contains(text)) {
+      out.push_back(spellings.at(text));
+    } else {
+      out.push_back(text);
+    }
+    if (text == "{") {
+      state.scopes.emplace_back();
+    } else if (text == "}") {
+      state.scopes.pop_back();
+    } else if (text == "=" && rule == "DECL’") {
+      declared_initialized = true;
+    }
+  }
+
+  Alternative const &Choose(std::string const &rule, size_t depth) {
+    std::vector<Alternative> const &alternatives = grammar.Alternatives(rule);
+    if (depth < max_depth && Chance(0.5)) {
+      return Pick(alternatives);
+    }
+    Alternative const *best = &alternatives.front();
+    for (Alternative const &alternative : alternatives) {
+      if (grammar.AlternativeDepth(alternative) <
+          grammar.AlternativeDepth(*best)) {
+        best = &alternative;
+      }
+    }
+    return *best;
+  }
+
+  // while (x) { { S } x = 0; }
+  void ExpandLoop(size_t depth) {
+    std::vector<std::string> readable = Visible(true);
+    std::string condition = readable.empty() ? "0" : Pick(readable);
+    for (std::string text : {"while", "(", condition.c_str(), ")", "{", "{"}) {
+      Emit({text, true}, "LOOP");
+    }
+    Expand("S", depth + 1);
+    Emit({"}", true}, "LOOP");
+    if (!readable.empty()) {
+      for (std::string text : {condition, std::string{"="}, std::string{"0"},
+                               std::string{";"}}) {
+        Emit({text, true}, "LOOP");
+      }
+    }
+    Emit({"}", true}, "LOOP");
+  }
+
+  void Expand(std::string const &rule, size_t depth) {
+    if (rule == "LOOP") {
+      ExpandLoop(depth);
+      return;
+    }
+    if (rule == "FOR") {
+      loop_vars.emplace_back();
+    }
+    for (Symbol const &symbol : Choose(rule, depth)) {
+      if (symbol.terminal) {
+        Emit(symbol, rule);
+      } else {
+        Expand(symbol.text, depth + 1);
+      }
+      // `var x = x;` must not see the new x, so it's added once the
+      // initializer is done (or there isn't one)
+      if (rule == "DECL" && !symbol.terminal) {
+        state.scopes.back().push_back({declaring, declared_initialized});
+        declared_initialized = false;
+      }
+    }
+    if (rule == "FOR") {
+      MarkInitialized(loop_vars.back());
+      loop_vars.pop_back();
+    }
+  }
+
+  static bool Parses(std::string const &source) {
+    bool saved_throw = throw_on_error;
+    throw_on_error = true;
+    std::streambuf *saved_cerr = std::cerr.rdbuf(nullptr);
+    bool ok = true;
+    try {
+      MacroCalc calc{source};
+    } catch (ErrorException const &) {
+      ok = false;
+    }
+    std::cerr.rdbuf(saved_cerr);
+    throw_on_error = saved_throw;
+    return ok;
+  }
+
+  // tokens back into source, a statement per line
+  static std::string Format(std::vector<std::string> const &tokens) {
+    std::string text{};
+    size_t indent = 0;
+    size_t parens = 0;
+    bool line_start = true;
+    std::string previous{};
+    for (std::string const &token : tokens) {
+      if (token == "}") {
+        indent -= indent ? 1 : 0;
+      }
+      if (line_start) {
+        text += std::string(2 * indent, ' ');
+      } else if (token != ";" && token != ")" && token != "," &&
+                 token != ":" && previous != "(" &&
+                 !(token == "(" && (previous == "print" || previous == "reduce"))) {
+        text += ' ';
+      }
+      text += token;
+      parens += token == "(";
+      parens -= token == ")" && parens;
+      previous = token;
+      line_start = (token == ";" && parens == 0) || token == "{" || token == "}";
+      if (line_start) {
+        text += '\n';
+      }
+      if (token == "{") {
+        ++indent;
+      }
+    }
+    return text;
+  }
+
+public:
+  Generator(Grammar const &grammar, uint64_t seed, size_t max_depth = 6)
+      : grammar(grammar), rng(seed), max_depth(max_depth) {}
+
+  // A program of up to `statements` top-level statements; each one gets a
+  // number of tries to come out in a form the parser accepts.
+  std::string Program(size_t statements) {
+    state = State{};
+    std::string source{};
+    for (size_t tries = 0, done = 0; done < statements && tries < statements * 50;
+         ++tries) {
+      State saved = state;
+      out.clear();
+      loop_vars.clear();
+      declared_initialized = false;
+      Expand("S", 0);
+      std::string statement = Format(out);
+      if (Parses(source + statement)) {
+        source += statement;
+        ++done;
+      } else {
+        state = saved;
+      }
+    }
+    return source;
+  }
+};
+
+} // namespace progen
@@ -0,0 +1,278 @@
+// Differential execution: runs each script under a reference engine and
+// under every other engine, and fails on any difference in stdout, exit
+// status, or the ERROR lines on stderr (the rest of stderr is reports).
+//
+// Usage: differential [--engine=name:command]... [--generate=N] [--seed=S]
+//                     [--statements=N] [--grammar=grammar.txt]
+//                     [--print-program] [--timeout=SECONDS] [script.Mc...]
+//
+// Commands have {} where the script goes, and the first engine is the
+// reference. Without --engine, ./Project2 is checked against the -O0 and
+// -O2 builds and against the instrumented execution paths. --generate adds
+// N random programs from ProgramGen.hpp; --print-program just prints the
+// one for --seed. Scripts are copied to a scratch directory first (engines
+// may write checkpoints next to them), and any that differ are left there.
+// (`make difftest` builds the engines and runs the lot.)
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ProgramGen.hpp"
+
+struct Engine {
+  std::string name;
+  std::string command;
+};
+
+struct Outcome {
+  std::string stdout_text{};
+  std::string error_lines{};
+  int status = 0;
+  bool timed_out = false;
+};
+
+struct Options {
+  std::vector<Engine> engines{};
+  std::vector<std::string> scripts{};
+  size_t generate = 0;
+  uint64_t seed = 1;
+  size_t statements = 12;
+  std::string grammar = "grammar.txt";
+  bool print_program = false;
+  int timeout_seconds = 20;
+};
+
+static std::vector<Engine> DefaultEngines() {
+  return {{"reference", "./Project2 {}"},
+          {"O0", "./Project2-O0 {}"},
+          {"O2", "./Project2-O2 {}"},
+          {"checkpointed", "./Project2 --checkpoint-every=1 {}"},
+          {"instrumented",
+           "./Project2 --cost --stats --profile --detect-infinite-loops=1 {}"}};
+}
+
+static std::string ReadFile(std::filesystem::path const &path) {
+  std::ifstream in(path);
+  return {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>{}};
+}
+
+// just the lines that report errors; profiles and stats vary run to run
+static std::string ErrorLines(std::string const &stderr_text) {
+  std::istringstream lines{stderr_text};
+  std::string line;
+  std::string out{};
+  while (std::getline(lines, line)) {
+    if (line.starts_with("ERROR")) {
+      out += line + '\n';
+    }
+  }
+  return out;
+}
+
+static Outcome RunEngine(Engine const &engine, std::filesystem::path const &script,
+                         int timeout_seconds) {
+  std::string command = engine.command;
+  size_t slot = command.find("{}");
+  if (slot != std::string::npos) {
+    command.replace(slot, 2, "'" + script.string() + "'");
+  }
+  std::filesystem::path out_path = script.string() + "." + engine.name + ".out";
+  std::filesystem::path err_path = script.string() + "." + engine.name + ".err";
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    std::cerr << "fork failed" << std::endl;
+    exit(1);
+  }
+  if (pid == 0) {
+    setpgid(0, 0);
+    int out_fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int err_fd = open(err_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dup2(out_fd, STDOUT_FILENO);
+    dup2(err_fd, STDERR_FILENO);
+    execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char *>(nullptr));
+    _exit(127);
+  }
+
+  Outcome outcome{};
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(timeout_seconds);
+  int status = 0;
+  while (waitpid(pid, &status, WNOHANG) == 0) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      kill(-pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      outcome.timed_out = true;
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  outcome.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  outcome.stdout_text = ReadFile(out_path);
+  outcome.error_lines = ErrorLines(ReadFile(err_path));
+  return outcome;
+}
+
+static std::string Describe(Outcome const &outcome) {
+  if (outcome.timed_out) {
+    return "timed out";
+  }
+  return "exit " + std::to_string(outcome.status) + ", " +
+         std::to_string(outcome.stdout_text.size()) + " bytes of output";
+}
+
+// true if every engine agrees with the reference
+static bool Compare(std::filesystem::path const &script, Options const &options) {
+  Outcome reference = RunEngine(options.engines.front(), script,
+                                options.timeout_seconds);
+  bool agree = !reference.timed_out;
+  for (size_t i = 1; i < options.engines.size(); ++i) {
+    Engine const &engine = options.engines[i];
+    Outcome outcome = RunEngine(engine, script, options.timeout_seconds);
+    std::string difference{};
+    if (outcome.timed_out) {
+      difference = "timed out";
+    } else if (outcome.status != reference.status) {
+      difference = "exit status";
+    } else if (outcome.stdout_text != reference.stdout_text) {
+      difference = "stdout";
+    } else if (outcome.error_lines != reference.error_lines) {
+      difference = "error lines";
+    }
+    if (!difference.empty()) {
+      agree = false;
+      std::cout << script.string() << ": " << engine.name << " differs in "
+                << difference << " (" << Describe(outcome) << "; "
+                << options.engines.front().name << ": " << Describe(reference)
+                << ")" << std::endl;
+    }
+  }
+  if (reference.timed_out) {
+    std::cout << script.string() << ": " << options.engines.front().name
+              << " timed out" << std::endl;
+  }
+  return agree;
+}
+
+static Options ParseOptions(int argc, char *argv[]) {
+  Options options{};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&arg](std::string const &name) -> std::string {
+      return arg.starts_with(name + "=") ? arg.substr(name.size() + 1) : "";
+    };
+    if (arg == "--print-program") {
+      options.print_program = true;
+    } else if (!value("--engine").empty()) {
+      std::string spec = value("--engine");
+      size_t colon = spec.find(':');
+      if (colon == std::string::npos) {
+        std::cerr << "Engine must be name:command, got '" << spec << "'"
+                  << std::endl;
+        exit(1);
+      }
+      options.engines.push_back({spec.substr(0, colon), spec.substr(colon + 1)});
+    } else if (!value("--generate").empty()) {
+      options.generate = std::stoul(value("--generate"));
+    } else if (!value("--seed").empty()) {
+      options.seed = std::stoull(value("--seed"));
+    } else if (!value("--statements").empty()) {
+      options.statements = std::stoul(value("--statements"));
+    } else if (!value("--grammar").empty()) {
+      options.grammar = value("--grammar");
+    } else if (!value("--timeout").empty()) {
+      options.timeout_seconds = std::stoi(value("--timeout"));
+    } else if (!arg.starts_with("--")) {
+      options.scripts.push_back(arg);
+    } else {
+      std::cerr << "Format: " << argv[0]
+                << " [--engine=name:command]... [--generate=N] [--seed=S]"
+                   " [--statements=N] [--grammar=grammar.txt]"
+                   " [--print-program] [--timeout=SECONDS] [script.Mc...]"
+                << std::endl;
+      exit(1);
+    }
+  }
+  if (options.engines.empty()) {
+    options.engines = DefaultEngines();
+  }
+  return options;
+}
+
+int main(int argc, char *argv[]) {
+  Options options = ParseOptions(argc, argv);
+  progen::Grammar grammar{};
+  if (options.generate || options.print_program) {
+    grammar = progen::Grammar::Load(options.grammar);
+  }
+  if (options.print_program) {
+    std::cout << progen::Generator{grammar, options.seed}.Program(
+        options.statements);
+    return 0;
+  }
+  if (options.engines.size() < 2) {
+    std::cerr << "Need a reference and at least one other engine." << std::endl;
+    return 1;
+  }
+
+  char scratch_template[] = "/tmp/differential-XXXXXX";
+  if (!mkdtemp(scratch_template)) {
+    std::cerr << "Unable to create a scratch directory." << std::endl;
+    return 1;
+  }
+  std::filesystem::path scratch{scratch_template};
+
+  std::vector<std::filesystem::path> scripts{};
+  for (std::string const &script : options.scripts) {
+    std::filesystem::path copy =
+        scratch / std::filesystem::path{script}.filename();
+    std::filesystem::copy_file(script, copy,
+                               std::filesystem::copy_options::overwrite_existing);
+    scripts.push_back(copy);
+  }
+  for (size_t i = 0; i < options.generate; ++i) {
+    uint64_t seed = options.seed + i;
+    std::filesystem::path path =
+        scratch / ("generated-" + std::to_string(seed) + ".Mc");
+    std::ofstream(path) << progen::Generator{grammar, seed}.Program(
+        options.statements);
+    scripts.push_back(path);
+  }
+
+  size_t differing = 0;
+  for (std::filesystem::path const &script : scripts) {
+    if (Compare(script, options)) {
+      // keep only what's needed to reproduce a difference
+      for (auto const &entry : std::filesystem::directory_iterator{scratch}) {
+        if (entry.path().string().starts_with(script.string())) {
+          std::filesystem::remove(entry.path());
+        }
+      }
+    } else {
+      ++differing;
+    }
+  }
+
+  std::cout << "Compared " << scripts.size() << " scripts across "
+            << options.engines.size() << " engines: " << differing
+            << " differ" << std::endl;
+  if (differing == 0) {
+    std::filesystem::remove_all(scratch);
+  } else {
+    std::cout << "Scripts and outputs kept in " << scratch.string() << std::endl;
+  }
+  return differing ? 1 : 0;
+}
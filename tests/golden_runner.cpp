@@ -0,0 +1,194 @@
+// Runs the golden tests in-process, on every core at once: each test-NN.Mc
+// is checked against expected/output-NN.txt, each test-error-NN.Mc must
+// stop with an error, and both kinds are checked against their
+// expected/cost-*.txt if they parse (scripts that don't never run, so they
+// have no cost file). Outputs are compared in memory, and a failure shows
+// the first line that differs.
+//
+// Usage: golden_runner [--dir=tests] [--jobs=N] [--filter=substring]
+// (`make golden-tests` builds and runs it; run_tests.sh does the same
+// checks one process at a time.)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../CostCounter.hpp"
+#include "../Error.hpp"
+#include "../MacroCalc.hpp"
+
+namespace fs = std::filesystem;
+
+struct Case {
+  std::string name; // ex. "05" or "error-03"
+  fs::path script;
+  bool expect_error;
+};
+
+struct Outcome {
+  std::vector<std::string> failures{};
+};
+
+static std::string ReadFile(fs::path const &path) {
+  std::ifstream in(path);
+  return {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>{}};
+}
+
+static std::vector<Case> FindCases(fs::path const &dir, std::string const &filter) {
+  std::vector<Case> cases{};
+  for (auto const &entry : fs::directory_iterator{dir}) {
+    std::string file = entry.path().filename().string();
+    if (!file.starts_with("test-") || !file.ends_with(".Mc")) {
+      continue;
+    }
+    std::string name = file.substr(5, file.size() - 8);
+    if (name.find(filter) != std::string::npos) {
+      cases.push_back({name, entry.path(), name.starts_with("error-")});
+    }
+  }
+  std::sort(cases.begin(), cases.end(),
+            [](Case const &a, Case const &b) { return a.name < b.name; });
+  return cases;
+}
+
+// "line N: expected ... / got ..." at the first line that differs
+static std::string FirstDifference(std::string const &expected,
+                                   std::string const &actual) {
+  std::istringstream want{expected};
+  std::istringstream got{actual};
+  std::string want_line;
+  std::string got_line;
+  for (size_t line = 1;; ++line) {
+    bool have_want = static_cast<bool>(std::getline(want, want_line));
+    bool have_got = static_cast<bool>(std::getline(got, got_line));
+    if (!have_want && !have_got) {
+      return "outputs differ only in the final newline";
+    }
+    if (have_want != have_got || want_line != got_line) {
+      return "line " + std::to_string(line) + ":\n      expected: " +
+             (have_want ? "'" + want_line + "'" : "<end of output>") +
+             "\n      got:      " +
+             (have_got ? "'" + got_line + "'" : "<end of output>");
+    }
+  }
+}
+
+static Outcome RunCase(Case const &test, fs::path const &dir) {
+  std::ostringstream output{};
+  std::ostringstream errors{};
+  CostCounter cost{};
+  script_output = &output;
+  error_output = &errors;
+  cost_counter = &cost;
+  throw_on_error = true;
+  bool errored = false;
+  bool parsed = false;
+  try {
+    MacroCalc calc{ReadFile(test.script)};
+    parsed = true;
+    calc.Execute();
+  } catch (ErrorException const &) {
+    errored = true;
+  }
+  script_output = &std::cout;
+  error_output = &std::cerr;
+  cost_counter = nullptr;
+
+  Outcome outcome{};
+  if (test.expect_error && !errored) {
+    outcome.failures.push_back("expected an error, but the script finished");
+  }
+  if (!test.expect_error) {
+    fs::path expected_path = dir / "expected" / ("output-" + test.name + ".txt");
+    if (!fs::exists(expected_path)) {
+      outcome.failures.push_back("missing " + expected_path.string());
+    } else if (std::string expected = ReadFile(expected_path);
+               expected != output.str()) {
+      outcome.failures.push_back("output differs at " +
+                                 FirstDifference(expected, output.str()));
+    }
+  }
+  // what `Project2 --cost` leaves on stderr: any error, then the counters
+  fs::path cost_path = dir / "expected" / ("cost-" + test.name + ".txt");
+  std::ostringstream cost_report{};
+  cost_report << errors.str();
+  cost.Report(cost_report);
+  if (!parsed) {
+    if (fs::exists(cost_path)) {
+      outcome.failures.push_back(cost_path.string() +
+                                 " exists, but the script doesn't parse");
+    }
+  } else if (!fs::exists(cost_path)) {
+    outcome.failures.push_back("missing " + cost_path.string());
+  } else if (std::string expected = ReadFile(cost_path);
+             expected != cost_report.str()) {
+    outcome.failures.push_back("cost differs at " +
+                               FirstDifference(expected, cost_report.str()));
+  }
+  return outcome;
+}
+
+int main(int argc, char *argv[]) {
+  fs::path dir = "tests";
+  size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+  std::string filter{};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.starts_with("--dir=")) {
+      dir = arg.substr(6);
+    } else if (arg.starts_with("--jobs=")) {
+      jobs = std::max<size_t>(1, std::stoul(arg.substr(7)));
+    } else if (arg.starts_with("--filter=")) {
+      filter = arg.substr(9);
+    } else {
+      std::cerr << "Format: " << argv[0]
+                << " [--dir=tests] [--jobs=N] [--filter=substring]" << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<Case> cases = FindCases(dir, filter);
+  instrumented = true; // every case counts its --cost work
+  std::vector<Outcome> outcomes(cases.size());
+  std::atomic<size_t> next{0};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers{};
+  for (size_t t = 0; t < std::min(jobs, cases.size()); ++t) {
+    workers.emplace_back([&]() {
+      for (size_t i = next++; i < cases.size(); i = next++) {
+        outcomes[i] = RunCase(cases[i], dir);
+      }
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  double elapsed_ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+
+  size_t failed = 0;
+  for (size_t i = 0; i < cases.size(); ++i) {
+    if (outcomes[i].failures.empty()) {
+      continue;
+    }
+    ++failed;
+    std::cout << "Test " << cases[i].name << " ... Failed." << '\n';
+    for (std::string const &failure : outcomes[i].failures) {
+      std::cout << "    " << failure << '\n';
+    }
+  }
+  std::cout << "Passed " << cases.size() - failed << " of " << cases.size()
+            << " tests (Failed " << failed << ") in " << elapsed_ms << " ms"
+            << std::endl;
+  return failed ? 1 : 0;
+}
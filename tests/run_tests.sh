@@ -3,11 +3,21 @@
 # Initialize a counter for differing files
 pass_count=0
 fail_count=0
-test_count=37
+test_count=45
 
 error_pass_count=0
 error_fail_count=0
-error_test_count=16
+error_test_count=22
+
+cost_pass_count=0
+cost_fail_count=0
+cost_skip_count=0
+
+thread_pass_count=0
+thread_fail_count=0
+
+estimate_pass_count=0
+estimate_fail_count=0
 
 # Make sure we have directory current/ to put results in.
 if [ ! -d "$DIR" ]; then
@@ -45,6 +55,25 @@ for i in $(seq -w 01 $test_count); do
     fi
 done
 
+# Run the tests with parallel for loops again with fixed thread counts: the
+# output must not depend on how the range is split.
+thread_tests=$(grep -l "parallel for" test-[0-9]*.Mc)
+for code_file in $thread_tests; do
+    i="${code_file#test-}"
+    i="${i%.Mc}"
+    expected_file="expected/output-${i}.txt"
+    for threads in 1 2 3 8; do
+        out_file="current/output-${i}-threads-${threads}.txt"
+        ../Project2 --threads=$threads "$code_file" > "$out_file"
+        if ! diff -q "$expected_file" "$out_file" > /dev/null; then
+            echo "Test $i with $threads threads ... Failed.  Files $expected_file and $out_file differ."
+            ((thread_fail_count++))
+        else
+            ((thread_pass_count++))
+        fi
+    done
+done
+
 # Loop through all the ERROR test file pairs
 for i in $(seq -w 01 $error_test_count); do
     # Set the file names
@@ -69,9 +98,57 @@ for i in $(seq -w 01 $error_test_count); do
     fi
 done
 
+# Loop through every test again, checking the --cost work counters. They
+# don't depend on the machine, so they must match exactly; if a change is
+# meant to alter them, regenerate the expected files with `make update-costs`.
+# Scripts that don't parse never run, so they have no cost file to check.
+for name in $(seq -f "%02g" 01 $test_count) $(seq -f "error-%02g" 01 $error_test_count); do
+    code_file="test-${name}.Mc"
+    expected_file="expected/cost-${name}.txt"
+    out_file="current/cost-${name}.txt"
+
+    if [[ ! -f "$code_file" ]]; then
+        echo "Code file $code_file does not exist."
+        ((cost_fail_count++))
+        continue
+    fi
+    if [[ ! -f "$expected_file" ]]; then
+        ((cost_skip_count++))
+        continue
+    fi
+    ../Project2 --cost "$code_file" 2> "$out_file" > /dev/null
+
+    if ! diff -q "$expected_file" "$out_file" > /dev/null; then
+        echo "Cost $name ... Failed.  Files $expected_file and $out_file differ."
+        ((cost_fail_count++))
+    else
+        ((cost_pass_count++))
+    fi
+done
+
+# Check --estimate for the tests that have an expected estimate (the class
+# and counts are static, so they must match exactly).
+for expected_file in expected/estimate-*.txt; do
+    name="${expected_file#expected/estimate-}"
+    name="${name%.txt}"
+    code_file="test-${name}.Mc"
+    out_file="current/estimate-${name}.txt"
+    ../Project2 --estimate "$code_file" 2> "$out_file" > /dev/null
+
+    if ! diff -q "$expected_file" "$out_file" > /dev/null; then
+        echo "Estimate $name ... Failed.  Files $expected_file and $out_file differ."
+        ((estimate_fail_count++))
+    else
+        ((estimate_pass_count++))
+    fi
+done
+
 # Report the final count of differing files
 echo "Passed $pass_count of $test_count regular tests (Failed $fail_count)"
 echo "Passed $error_pass_count of $error_test_count error tests (Failed $error_fail_count)"
+echo "Passed $thread_pass_count of $((thread_pass_count + thread_fail_count)) fixed thread count runs (Failed $thread_fail_count)"
+echo "Passed $estimate_pass_count of $((estimate_pass_count + estimate_fail_count)) estimate checks (Failed $estimate_fail_count)"
+echo "Passed $cost_pass_count of $((cost_pass_count + cost_fail_count)) cost checks (Failed $cost_fail_count, $cost_skip_count scripts without a cost file)"
 
-total_fail_count=$((fail_count + error_fail_count))
+total_fail_count=$((fail_count + error_fail_count + thread_fail_count + estimate_fail_count + cost_fail_count))
 exit $total_fail_count
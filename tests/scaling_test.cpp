@@ -0,0 +1,206 @@
+// Asymptotic scaling tests for the front end.
+//
+// Each stage is run on inputs that double in size, the growth exponent k in
+// time ~ n^k is fit by least squares on the log-log points, and the stage
+// fails if k exceeds its declared bound. Bounds carry some slack for timing
+// noise; a stage that went quadratic lands near 2 and fails clearly.
+//
+// Usage: scaling_test [--filter=substring]   (or `make scaling-tests`)
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../MacroCalc.hpp"
+#include "../RunStats.hpp"
+#include "../SymbolTable.hpp"
+#include "../lexer.hpp"
+
+struct Stage {
+  std::string name;
+  std::string bound_name;
+  double max_exponent;
+  size_t base_size;
+  // runs the stage at size n and returns the time it took in ms
+  std::function<double(size_t n)> run;
+};
+
+using clock_type = std::chrono::steady_clock;
+
+static double MillisSince(clock_type::time_point start) {
+  return std::chrono::duration<double, std::milli>(clock_type::now() - start)
+      .count();
+}
+
+static std::string Repeat(std::string const &line, size_t n) {
+  std::string out{};
+  out.reserve(line.size() * n);
+  for (size_t i = 0; i < n; ++i) {
+    out += line;
+  }
+  return out;
+}
+
+static std::string FlatSource(size_t n) {
+  std::string source = "var x = 0;\nvar y = 1;\n";
+  source += Repeat("x = y; y = 2.5;\n", n);
+  return source;
+}
+
+static std::string NestedSource(size_t n) {
+  std::string source = "var x = 0;\n";
+  source += Repeat("{ x = 1;\n", n);
+  source += Repeat("}\n", n);
+  return source;
+}
+
+// one left-deep whole-array expression with n terms
+static std::string ChainSource(size_t n) {
+  std::string source = "var a[4];\na = a";
+  source += Repeat(" + a", n - 1);
+  source += ";\n";
+  return source;
+}
+
+// a stage whose output is wrong fails however it scales
+static size_t wrong_results = 0;
+
+static double LexTime(std::string const &source, size_t expected_tokens) {
+  emplex::Lexer lexer{};
+  auto start = clock_type::now();
+  std::vector<emplex::Token> tokens = lexer.Tokenize(source);
+  double elapsed = MillisSince(start);
+  if (tokens.size() != expected_tokens) {
+    std::cerr << "lexer produced " << tokens.size() << " tokens, expected "
+              << expected_tokens << std::endl;
+    ++wrong_results;
+  }
+  return elapsed;
+}
+
+// uses the --stats phase timers so lexing isn't counted as parsing
+static double ParseTime(std::string const &source) {
+  RunStats stats{};
+  run_stats = &stats;
+  { MacroCalc calc{source}; }
+  run_stats = nullptr;
+  return stats.Get("parse").wall_ms;
+}
+
+static std::vector<Stage> Stages() {
+  return {
+      {"lex/statements", "n", 1.25, 4000,
+       [](size_t n) { return LexTime(FlatSource(n), 10 + 8 * n); }},
+      {"lex/line_comments", "n", 1.25, 4000,
+       [](size_t n) {
+         return LexTime(Repeat("// a comment about the next line\nx = 1;\n", n),
+                        4 * n);
+       }},
+      {"lex/block_comments", "n", 1.25, 4000,
+       [](size_t n) {
+         return LexTime(Repeat("/* a comment */ x = 1;\n", n), 4 * n);
+       }},
+      {"parse/flat_statements", "n log n", 1.35, 4000,
+       [](size_t n) { return ParseTime(FlatSource(n)); }},
+      {"parse/nested_scopes", "n log n", 1.35, 250,
+       [](size_t n) { return ParseTime(NestedSource(n)); }},
+      {"parse/expression_chain", "n", 1.25, 250,
+       [](size_t n) { return ParseTime(ChainSource(n)); }},
+      // the table outgrows the caches as it grows, so it gets more slack
+      {"symbol_table/add_and_find", "n", 1.35, 1000,
+       [](size_t n) {
+         std::vector<std::string> names{};
+         for (size_t i = 0; i < n; ++i) {
+           names.push_back("v" + std::to_string(i));
+         }
+         auto start = clock_type::now();
+         SymbolTable table{};
+         for (std::string const &name : names) {
+           table.AddVar(name, 1);
+         }
+         [[maybe_unused]] volatile size_t found = 0;
+         for (std::string const &name : names) {
+           found = table.FindVar(name, 1);
+         }
+         return MillisSince(start);
+       }},
+      {"symbol_table/scope_churn", "n", 1.25, 8000,
+       [](size_t n) {
+         auto start = clock_type::now();
+         SymbolTable table{};
+         for (size_t i = 0; i < n; ++i) {
+           table.PushScope();
+           table.AddVar("a", 1);
+           table.PopScope();
+         }
+         return MillisSince(start);
+       }},
+  };
+}
+
+// slope of log(time) against log(size)
+static double FitExponent(std::vector<double> const &sizes,
+                          std::vector<double> const &times) {
+  double mean_x = 0, mean_y = 0;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    mean_x += std::log(sizes[i]);
+    mean_y += std::log(std::max(times[i], 1e-6));
+  }
+  mean_x /= static_cast<double>(sizes.size());
+  mean_y /= static_cast<double>(sizes.size());
+  double covariance = 0, variance = 0;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    double dx = std::log(sizes[i]) - mean_x;
+    covariance += dx * (std::log(std::max(times[i], 1e-6)) - mean_y);
+    variance += dx * dx;
+  }
+  return covariance / variance;
+}
+
+int main(int argc, char *argv[]) {
+  std::string filter{};
+  if (argc == 2 && std::string{argv[1]}.starts_with("--filter=")) {
+    filter = std::string{argv[1]}.substr(9);
+  } else if (argc != 1) {
+    std::cerr << "Format: " << argv[0] << " [--filter=substring]" << std::endl;
+    return 1;
+  }
+
+  constexpr size_t DOUBLINGS = 6;
+  constexpr size_t REPETITIONS = 3;
+
+  int failures = 0;
+  for (Stage const &stage : Stages()) {
+    if (stage.name.find(filter) == std::string::npos) {
+      continue;
+    }
+    std::vector<double> sizes{};
+    std::vector<double> times{};
+    for (size_t step = 0, n = stage.base_size; step < DOUBLINGS;
+         ++step, n *= 2) {
+      // best of a few runs, the least disturbed by the rest of the machine
+      double best = stage.run(n);
+      for (size_t rep = 1; rep < REPETITIONS; ++rep) {
+        best = std::min(best, stage.run(n));
+      }
+      sizes.push_back(static_cast<double>(n));
+      times.push_back(best);
+    }
+    double exponent = FitExponent(sizes, times);
+    bool passed = exponent <= stage.max_exponent && wrong_results == 0;
+    wrong_results = 0;
+    failures += !passed;
+    std::cout << std::left << std::setw(28) << stage.name << std::right
+              << std::fixed << std::setprecision(2) << "n^" << exponent
+              << "  (bound " << stage.bound_name << ", n^"
+              << stage.max_exponent << ")  " << std::setprecision(3)
+              << times.front() << " -> " << times.back() << " ms  "
+              << (passed ? "Passed!" : "FAILED") << std::endl;
+  }
+  return failures;
+}